@@ -5,10 +5,16 @@
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include <future>
 #include <map>
+#include <memory>
+#include <set>
 #include <wayland-client.h>
 #include "protocols/xdg-shell-client-protocol.h"
 #include "protocols/pointer-gestures-unstable-v1-client-protocol.h"
+#include "protocols/viewporter-client-protocol.h"
+#include "protocols/presentation-time-client-protocol.h"
+#include "protocols/fractional-scale-v1-client-protocol.h"
 
 // Forward declarations for Wayland listener structs
 extern const struct wl_registry_listener registry_listener;
@@ -19,46 +25,215 @@ extern const struct xdg_toplevel_listener xdg_toplevel_listener;
 
 #include <map>
 #include <chrono>
+#include <cairo.h>
 #include <Imlib2.h>
 
+// How a PixelBuffer stores its pixels. The compact formats are expanded
+// to ARGB32 only for the part being drawn.
+enum pixel_format {
+  PIXEL_ARGB32,   // Premultiplied ARGB32, as Cairo uses it
+  PIXEL_RGB24,    // Packed B, G, R bytes, opaque
+  PIXEL_GRAY8,    // One luma byte, opaque
+  PIXEL_INDEXED8, // One byte into `palette`
+};
+
+// Decoded pixels, rows packed without padding, or in square tiles of
+// packed rows for very large frames (see pixel_offset()). Shared so
+// background jobs can keep reading a frame after the cache has replaced or
+// evicted it.
+struct PixelBuffer {
+  int width, height;
+  pixel_format format;
+  int tile; // Side of the tiles, 0 for plain rows
+  std::vector<uint8_t> data;
+  std::shared_ptr<const std::vector<uint32_t>> palette; // ARGB32 entries, PIXEL_INDEXED8 only
+};
+typedef std::shared_ptr<const PixelBuffer> PixelBufferRef;
+
 struct CachedImage {
-  std::vector<Imlib_Image> frames;
+  std::vector<PixelBufferRef> frames; // Only the first frame of an animation
+  std::vector<PixelBufferRef> mips; // Half, quarter, ... of frame 0, built lazily
   std::vector<int> delays; // in milliseconds
-  std::vector<std::string> exif_data;
+  std::vector<std::string> exif_data; // Filled lazily by a metadata job
+  bool exif_loaded;
+  int width, height;             // Full image size
+  int frame_width, frame_height; // Size of the decoded frames; smaller after a scaled JPEG decode
+  bool has_alpha;
+  bool animated; // A GIF with more frames than the cached first one
+  size_t bytes;       // Decoded size, counted against the cache budget
+  uint64_t last_used; // cache_clock value when last inserted or shown
+};
+
+struct decoder;
+struct gif_player;
+struct worker_pool;
+struct refiner;
+struct event_loop;
+
+// One SHM buffer of the swap pool
+struct shm_buffer {
+  struct wl_buffer *buffer;
+  int fd;
+  void *data;
+  size_t size;
+  int width, height, stride;
+  bool busy; // Attached, and not yet released by the compositor
+  cairo_region_t *damage; // Buffer pixels that changed since it was last drawn
+};
+
+// Swap buffers of one surface
+struct buffer_pool {
+  struct shm_buffer buffers[3];
+  int count;
+  bool starved; // A redraw found every buffer busy; retried on release
+};
+
+// A subsurface above the image for the info box or the tray. With its own
+// small buffers, showing or changing it never repaints the image.
+struct overlay_surface {
+  struct wl_surface *surface;
+  struct wl_subsurface *subsurface;
+  struct wp_viewport *viewport; // Sizes it at fractional scales, else null
+  struct buffer_pool pool;
+  bool shown;   // Has a buffer attached
+  double scale; // buffer_scale it was drawn at
+  bool placed;  // x, y were set on the subsurface
+  int x, y;     // Position last set, applied by the next commit of the image surface
+};
+
+// The whole image scaled once into its own buffer, on a subsurface under
+// the overlays. While zooming or panning, wp_viewport crops and stretches
+// it, so a gesture frame is a commit instead of a CPU redraw.
+struct scaled_view {
+  struct wl_surface *surface;
+  struct wl_subsurface *subsurface;
+  struct wp_viewport *viewport;
+  struct buffer_pool pool;
+  bool shown;                 // Has a buffer attached
+  size_t index;               // Image the attached buffer was scaled from
+  PixelBufferRef frame;       // and its frame, to notice a sharper decode
+  int width, height;          // Size of the attached buffer
+  int backdrop_width, backdrop_height; // Image surface buffer drawn blank under the view, 0 if it shows the image
+};
+
+// The last high quality rendering of the image, around the view and a
+// margin beyond it. Pans at the same zoom are copied from it instead of
+// resampled again.
+struct hq_cache {
+  std::vector<uint32_t> pixels;
+  cairo_rectangle_int_t rect; // Buffer pixels it covered when rendered
+  int origin_x, origin_y;     // The image's top-left in buffer pixels then
+  size_t index;
+  PixelBufferRef frame;       // First frame of the image, to notice a sharper decode
+  PixelBufferRef source;      // Frame or mip level it was scaled from
+  float zoom;
+  double scale;               // buffer_scale
+  int draw_width, draw_height; // Size of the whole image in buffer pixels
+};
+
+// The view a quality pass renders for, copied from app_state so the pass
+// can run while the view moves on
+struct hq_request {
+  size_t index;
+  PixelBufferRef frame, source; // As in hq_cache
+  bool has_alpha;
+  bool playing;                 // An animation; its frames do not last
+  float zoom;
+  double scale;                 // buffer_scale
+  int width, height;            // Window size
+  double draw_w, draw_h;        // Image size on screen, surface coordinates
+  double offset_x, offset_y;    // Image top-left on screen
+};
+
+// What the info overlay's lines are made from. They are rebuilt and
+// measured only when this changes, not on every frame of an animation.
+struct info_source {
+  size_t index, count;
   int width, height;
+  float zoom;
+  size_t cached, cache_bytes, cache_peak_bytes, cache_budget;
+  unsigned cache_hits, cache_misses;
+  bool exif_loaded;
+  size_t exif_lines;
+};
+
+// Pointer input since the last wl_pointer.frame, applied as one update
+struct pointer_input {
+  bool moved;
+  double start_y;            // mouse_y before the group's first motion
+  double scroll_x, scroll_y; // Axis values summed over the group
+};
+
+// When frames of the main surface reach the screen, from wp_presentation
+// feedback, in CLOCK_MONOTONIC nanoseconds
+struct present_timing {
+  bool valid;      // A commit has been presented
+  int64_t vblank;  // When the last one was
+  int64_t refresh; // Refresh period, 0 if there is no fixed one
+  int64_t latency; // Average time from commit to presentation
+};
+
+// What the overlays show and where, in surface coordinates
+struct overlay_layout {
+  std::vector<std::string> info_lines; // Empty while the info overlay is hidden
+  info_source info_key;                // What info_lines were made from
+  cairo_rectangle_int_t info_rect;
+  bool tray_visible;
+  cairo_rectangle_int_t tray_rect;
 };
 
 struct app_state {
   struct wl_display *display;
   struct wl_registry *registry;
   struct wl_compositor *compositor;
+  struct wl_subcompositor *subcompositor;
   struct wl_shm *shm;
+  struct wp_viewporter *viewporter; // Optional; without it gestures redraw on the CPU
+  struct wp_presentation *presentation; // Optional; without it animations follow the wall clock
+  bool presentation_monotonic;      // Its timestamps are on CLOCK_MONOTONIC
+  present_timing timing;
+  struct wp_fractional_scale_manager_v1 *fractional_scale_manager; // Optional; used only with wp_viewporter
   struct xdg_wm_base *xdg_wm_base;
 
   struct wl_surface *surface;
   struct xdg_surface *xdg_surface;
   struct xdg_toplevel *xdg_toplevel;
-  struct wl_buffer *buffer;
+  struct wp_viewport *viewport;               // Sizes the window at fractional scales, else null
+  struct wp_fractional_scale_v1 *fractional_scale;
 
   int32_t width, height;
-  int32_t buffer_scale; // HiDPI scale factor
+  double buffer_scale;      // Buffer pixels per surface pixel
+  int32_t output_scale;     // wl_output's integer scale
+  uint32_t preferred_scale; // wp_fractional_scale_v1's, in 120ths; 0 until sent
   bool configured;
   int running;
 
-  std::map<size_t, CachedImage> cache;
+  std::map<size_t, CachedImage> cache; // Only touched on the Wayland thread
+  struct event_loop *loop;             // Timer and worker wakeups of the main loop
+  struct decoder *decoder;             // Background decode workers
+  std::vector<size_t> prefetch_plan;   // Current image first, then neighbors to keep
+  std::set<size_t> decode_failed;      // Images whose pixels could not be decoded; not queued again
+  size_t cache_budget;                 // Max decoded bytes (--cache-mb)
+  size_t cache_bytes, cache_peak_bytes;
+  uint64_t cache_clock;
+  unsigned cache_hits, cache_misses;   // Was the image already decoded on navigation
   
   // Animation state
-  int current_frame_index;
-  std::chrono::steady_clock::time_point last_frame_time;
+  struct gif_player *player; // Plays the current image if it is animated
   bool is_animating; // actively animating (physics/rebound)
 
   struct wl_seat *seat;
   struct wl_keyboard *keyboard;
   struct wl_pointer *pointer;
+  struct pointer_input pointer_input;
   uint32_t modifiers;
 
   std::vector<std::string> images;
   size_t current_index;
+  int travel_dir; // +1 or -1, direction of the last navigation step
+  float nav_bias; // Recent step directions, -1 (all backward) to +1 (all forward)
+  float nav_rate; // Recent navigation speed in steps per second
+  std::chrono::steady_clock::time_point last_nav_time;
   bool show_info;
   
   double mouse_x, mouse_y;
@@ -68,12 +243,25 @@ struct app_state {
   bool zooming_in, zooming_out; // Flags for continuous keyboard zoom
   struct zwp_pointer_gestures_v1 *gestures;
 
-  int shm_fd;
-  void *shm_data;
-  size_t shm_size;
+  struct worker_pool *workers;  // Split the quality redraw across cores (--render-threads)
+  struct hq_cache hq;           // Lets pans skip the quality resample
+  struct refiner *refiner;      // Renders quality passes into `hq` off this thread
+  hq_request refine_request;    // The pass last started
+  bool refining;                // ... and it has not landed or been cancelled
+  struct buffer_pool pool;      // Two buffers normally, a third while animating
+  cairo_region_t *damage;       // Buffer pixels changed since the last commit
+  struct scaled_view view;      // Stands in for the image during gestures
+  struct overlay_surface info, tray;
+  overlay_layout overlays_drawn;
+  std::future<cairo_scaled_font_t*> font_loading; // Resolves the overlay font off this thread
+  cairo_scaled_font_t *font;    // Overlay text font, taken from font_loading when first needed
+  bool overlays_pending;        // The overlays may need updating; no image redraw needed
+  bool overlays_moved;          // An overlay position waits for a commit of the image surface
   bool redraw_pending;
   bool needs_hq_update; // Flag to ensure we trigger a final high-quality redraw
   struct wl_callback *frame_callback;
+  uint32_t frame_time;   // Timestamp of the last frame callback, in ms
+  bool frame_time_valid; // ... and it was a frame of the running animation
   float pan_x, pan_y;
   float target_pan_x, target_pan_y; // Target pan for rebound animation
   bool is_panning; // Active mouse-drag panning flag
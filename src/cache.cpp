@@ -0,0 +1,77 @@
+#include "cache.h"
+#include "loader.h"
+#include <algorithm>
+
+static size_t pixel_buffer_bytes(const PixelBuffer &buf) {
+  size_t bytes = buf.data.size();
+  if (buf.palette) bytes += buf.palette->size() * sizeof(uint32_t);
+  return bytes;
+}
+
+size_t cached_image_bytes(const CachedImage &img) {
+  size_t bytes = 0;
+  for (const auto &frame : img.frames) bytes += pixel_buffer_bytes(*frame);
+  for (const auto &level : img.mips) bytes += pixel_buffer_bytes(*level);
+  return bytes;
+}
+
+void cache_insert(struct app_state *app, size_t index, CachedImage &&img) {
+  auto it = app->cache.find(index);
+  if (it != app->cache.end()) {
+    app->cache_bytes -= it->second.bytes;
+    app->cache.erase(it);
+  }
+
+  img.bytes = cached_image_bytes(img);
+  img.last_used = ++app->cache_clock;
+  app->cache_bytes += img.bytes;
+  app->cache_peak_bytes = std::max(app->cache_peak_bytes, app->cache_bytes);
+  app->cache[index] = std::move(img);
+}
+
+void cache_update_bytes(struct app_state *app, size_t index) {
+  auto it = app->cache.find(index);
+  if (it == app->cache.end()) return;
+
+  app->cache_bytes -= it->second.bytes;
+  it->second.bytes = cached_image_bytes(it->second);
+  app->cache_bytes += it->second.bytes;
+  app->cache_peak_bytes = std::max(app->cache_peak_bytes, app->cache_bytes);
+}
+
+void cache_touch(struct app_state *app, size_t index) {
+  auto it = app->cache.find(index);
+  if (it != app->cache.end()) it->second.last_used = ++app->cache_clock;
+}
+
+// Lower is evicted first
+static bool keep_less(struct app_state *app, size_t a_idx, const CachedImage &a, size_t b_idx, const CachedImage &b) {
+  int a_rank = loader_plan_rank(app, a_idx);
+  int b_rank = loader_plan_rank(app, b_idx);
+  if ((a_rank < 0) != (b_rank < 0)) return a_rank < 0;
+
+  if (a_rank >= 0) return a_rank > b_rank;
+  return a.last_used < b.last_used;
+}
+
+void cache_evict(struct app_state *app) {
+  while (app->cache_bytes > app->cache_budget) {
+    auto victim = app->cache.end();
+    for (auto it = app->cache.begin(); it != app->cache.end(); ++it) {
+      if (it->first == app->current_index) continue;
+      if (victim == app->cache.end() ||
+          keep_less(app, it->first, it->second, victim->first, victim->second)) {
+        victim = it;
+      }
+    }
+    if (victim == app->cache.end()) break; // Only the current image is left
+
+    app->cache_bytes -= victim->second.bytes;
+    app->cache.erase(victim);
+  }
+}
+
+size_t cache_estimate_bytes(struct app_state *app) {
+  if (app->cache.empty()) return 0;
+  return app->cache_bytes / app->cache.size();
+}
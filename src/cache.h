@@ -0,0 +1,25 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "app.h"
+
+size_t cached_image_bytes(const CachedImage &img);
+
+// Insert a decoded image and account for its memory
+void cache_insert(struct app_state *app, size_t index, CachedImage &&img);
+
+// Re-account an entry after something was added to it, e.g. mipmaps
+void cache_update_bytes(struct app_state *app, size_t index);
+
+// Mark an entry as just used, for LRU ordering
+void cache_touch(struct app_state *app, size_t index);
+
+// Evict until the cache fits its byte budget. The current image is never
+// evicted; images outside the prefetch plan go first (least recently used
+// first), then planned neighbors from the end of the plan.
+void cache_evict(struct app_state *app);
+
+// Typical decoded size of an entry, used to plan prefetch against the budget
+size_t cache_estimate_bytes(struct app_state *app);
+
+#endif
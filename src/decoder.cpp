@@ -0,0 +1,113 @@
+#include "decoder.h"
+#include "loader.h"
+#include "mipmap.h"
+#include <algorithm>
+#include <unistd.h>
+
+static void worker_main(struct decoder *dec) {
+  std::unique_lock<std::mutex> lock(dec->mutex);
+  while (true) {
+    dec->work_cv.wait(lock, [dec] { return dec->stopping || !dec->queue.empty(); });
+    if (dec->stopping) return;
+
+    decode_job job = std::move(dec->queue.front());
+    dec->queue.pop_front();
+    job.cancelled = std::make_shared<std::atomic<bool>>(false);
+    auto slot = dec->running.emplace(decode_key(job.index, job.kind), job.cancelled);
+    lock.unlock();
+
+    decode_result result = {};
+    result.index = job.index;
+    result.kind = job.kind;
+    if (job.kind == DECODE_PIXELS) {
+      result.ok = decode_image(job.path, job.target_w, job.target_h, &result.image, job.cancelled.get());
+    } else if (job.kind == DECODE_METADATA) {
+      result.ok = decode_metadata(job.path, &result.image);
+    } else {
+      result.source = job.source;
+      result.image.mips = build_mipmaps(*job.source, job.cancelled.get());
+      result.ok = !result.image.mips.empty();
+    }
+
+    lock.lock();
+    dec->running.erase(slot);
+    if (!job.cancelled->load()) dec->done.push_back(std::move(result));
+
+    uint64_t one = 1;
+    if (write(dec->wake_fd, &one, sizeof(one)) < 0) {
+      // Counter overflow is the only failure; the fd is already readable
+    }
+    dec->done_cv.notify_all();
+  }
+}
+
+struct decoder *decoder_create(int threads, int wake_fd) {
+  struct decoder *dec = new decoder();
+  dec->wake_fd = wake_fd;
+  dec->stopping = false;
+
+  for (int i = 0; i < threads; ++i) {
+    dec->threads.emplace_back(worker_main, dec);
+  }
+  return dec;
+}
+
+void decoder_destroy(struct decoder *dec) {
+  {
+    std::lock_guard<std::mutex> lock(dec->mutex);
+    dec->stopping = true;
+    dec->queue.clear();
+    for (auto &entry : dec->running) entry.second->store(true);
+  }
+  dec->work_cv.notify_all();
+  for (std::thread &t : dec->threads) t.join();
+  delete dec;
+}
+
+static bool is_queued(struct decoder *dec, decode_key key) {
+  for (const decode_job &job : dec->queue) {
+    if (job.index == key.first && job.kind == key.second) return true;
+  }
+  return false;
+}
+
+void decoder_schedule(struct decoder *dec, std::vector<decode_job> jobs) {
+  {
+    std::lock_guard<std::mutex> lock(dec->mutex);
+
+    std::map<decode_key, bool> wanted;
+    for (const decode_job &job : jobs) wanted[decode_key(job.index, job.kind)] = true;
+    for (auto &entry : dec->running) {
+      if (!wanted.count(entry.first)) entry.second->store(true);
+    }
+
+    // A job cancelled earlier may still be unwinding; queue a fresh one
+    // rather than trusting its result
+    dec->queue.clear();
+    for (decode_job &job : jobs) {
+      auto range = dec->running.equal_range(decode_key(job.index, job.kind));
+      bool live = std::any_of(range.first, range.second, [](const auto &entry) { return !entry.second->load(); });
+      if (!live) dec->queue.push_back(std::move(job));
+    }
+  }
+  dec->work_cv.notify_all();
+}
+
+bool decoder_is_pending(struct decoder *dec, size_t index, decode_kind kind) {
+  std::lock_guard<std::mutex> lock(dec->mutex);
+  decode_key key(index, kind);
+  return dec->running.count(key) || is_queued(dec, key);
+}
+
+void decoder_wait(struct decoder *dec, size_t index) {
+  std::unique_lock<std::mutex> lock(dec->mutex);
+  decode_key key(index, DECODE_PIXELS);
+  dec->done_cv.wait(lock, [dec, key] { return !dec->running.count(key) && !is_queued(dec, key); });
+}
+
+std::vector<decode_result> decoder_take_results(struct decoder *dec) {
+  std::vector<decode_result> results;
+  std::lock_guard<std::mutex> lock(dec->mutex);
+  results.swap(dec->done);
+  return results;
+}
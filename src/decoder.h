@@ -0,0 +1,69 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include "app.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+enum decode_kind {
+  DECODE_PIXELS,   // Fills a whole CachedImage except its metadata
+  DECODE_METADATA, // Fills only exif_data, merged into an existing entry
+  DECODE_MIPMAPS,  // Fills only mips from `source`, merged into an existing entry
+};
+
+// Jobs are identified by image and kind
+typedef std::pair<size_t, decode_kind> decode_key;
+
+// A finished decode, handed back to the Wayland thread
+struct decode_result {
+  size_t index;
+  decode_kind kind;
+  bool ok;
+  CachedImage image;
+  PixelBufferRef source; // The frame mipmaps were built from
+};
+
+struct decode_job {
+  size_t index;
+  decode_kind kind;
+  std::string path;
+  int target_w, target_h; // Pixels the image must cover when fitted, 0 for full size
+  PixelBufferRef source;  // Frame to reduce, for DECODE_MIPMAPS
+  std::shared_ptr<std::atomic<bool>> cancelled; // Set when the job drops out of the plan mid-decode
+};
+
+struct decoder {
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable work_cv; // Wakes workers when jobs are queued
+  std::condition_variable done_cv; // Wakes decoder_wait() when a job finishes
+  std::deque<decode_job> queue;    // Highest priority first
+  std::multimap<decode_key, std::shared_ptr<std::atomic<bool>>> running; // In flight
+  std::vector<decode_result> done;
+  int wake_fd;                     // The event loop's eventfd, signalled when a job finishes
+  bool stopping;
+};
+
+struct decoder *decoder_create(int threads, int wake_fd);
+void decoder_destroy(struct decoder *dec);
+
+// Replace the queue with `jobs`, given highest priority first. Queued jobs
+// that are not listed are dropped, in-flight ones are cancelled, and jobs
+// already in flight are not queued twice.
+void decoder_schedule(struct decoder *dec, std::vector<decode_job> jobs);
+
+// Whether a job of the given kind is queued or in flight for an image
+bool decoder_is_pending(struct decoder *dec, size_t index, decode_kind kind);
+
+// Block until the pixels of the given index are no longer pending
+void decoder_wait(struct decoder *dec, size_t index);
+
+// Take ownership of all finished decodes
+std::vector<decode_result> decoder_take_results(struct decoder *dec);
+
+#endif
@@ -0,0 +1,202 @@
+#include "exif.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+// Bounds-checked view of a TIFF blob (the body of an EXIF segment)
+struct tiff_reader {
+  const uint8_t *data;
+  size_t size;
+  bool big_endian;
+};
+
+static bool read_u16(const tiff_reader &t, size_t off, uint16_t *v) {
+  if (off + 2 > t.size) return false;
+  const uint8_t *p = t.data + off;
+  *v = t.big_endian ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+  return true;
+}
+
+static bool read_u32(const tiff_reader &t, size_t off, uint32_t *v) {
+  if (off + 4 > t.size) return false;
+  const uint8_t *p = t.data + off;
+  *v = t.big_endian ? ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3])
+                    : ((uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+  return true;
+}
+
+enum { TIFF_ASCII = 2, TIFF_SHORT = 3, TIFF_LONG = 4, TIFF_RATIONAL = 5 };
+
+enum {
+  TAG_MAKE = 0x010F,
+  TAG_MODEL = 0x0110,
+  TAG_EXIF_IFD = 0x8769,
+  TAG_EXPOSURE_TIME = 0x829A,
+  TAG_FNUMBER = 0x829D,
+  TAG_ISO = 0x8827,
+  TAG_DATETIME_ORIGINAL = 0x9003,
+};
+
+struct exif_fields {
+  std::string make, model, exposure, fnumber, iso, datetime;
+  uint32_t exif_ifd;
+};
+
+// Offset of an entry's value: inline in the entry when it fits in 4 bytes
+static bool value_offset(const tiff_reader &t, size_t entry, uint16_t type, uint32_t count, size_t *off) {
+  static const int type_size[] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8};
+  if (type == 0 || type >= sizeof(type_size) / sizeof(type_size[0])) return false;
+  uint64_t bytes = (uint64_t)type_size[type] * count;
+  if (bytes <= 4) {
+    *off = entry + 8;
+    return true;
+  }
+  uint32_t ptr;
+  if (!read_u32(t, entry + 8, &ptr) || ptr + bytes > t.size) return false;
+  *off = ptr;
+  return true;
+}
+
+static std::string read_ascii(const tiff_reader &t, size_t off, uint32_t count) {
+  if (off + count > t.size) return "";
+  std::string s((const char*)t.data + off, count);
+  s = s.substr(0, s.find('\0'));
+  while (!s.empty() && s.back() == ' ') s.pop_back();
+  return s;
+}
+
+static bool read_rational(const tiff_reader &t, size_t off, double *v, uint32_t *num, uint32_t *den) {
+  if (!read_u32(t, off, num) || !read_u32(t, off + 4, den) || *den == 0) return false;
+  *v = (double)*num / *den;
+  return true;
+}
+
+static void parse_ifd(const tiff_reader &t, uint32_t ifd, exif_fields *f) {
+  uint16_t entries;
+  if (!read_u16(t, ifd, &entries)) return;
+
+  for (uint16_t i = 0; i < entries; ++i) {
+    size_t entry = ifd + 2 + (size_t)i * 12;
+    uint16_t tag, type;
+    uint32_t count;
+    size_t off;
+    if (!read_u16(t, entry, &tag) || !read_u16(t, entry + 2, &type) || !read_u32(t, entry + 4, &count)) return;
+    if (!value_offset(t, entry, type, count, &off)) continue;
+
+    char buf[64];
+    double v;
+    uint32_t num, den;
+    if (tag == TAG_MAKE && type == TIFF_ASCII) {
+      f->make = read_ascii(t, off, count);
+    } else if (tag == TAG_MODEL && type == TIFF_ASCII) {
+      f->model = read_ascii(t, off, count);
+    } else if (tag == TAG_EXIF_IFD && (type == TIFF_LONG || type == 13)) {
+      read_u32(t, off, &f->exif_ifd);
+    } else if (tag == TAG_EXPOSURE_TIME && type == TIFF_RATIONAL && read_rational(t, off, &v, &num, &den)) {
+      // Same style as exiv2: "1/200 s" below a second, "2.5 s" above
+      if (v > 0 && v < 1) snprintf(buf, sizeof(buf), "1/%.0f s", 1.0 / v);
+      else snprintf(buf, sizeof(buf), "%g s", v);
+      f->exposure = buf;
+    } else if (tag == TAG_FNUMBER && type == TIFF_RATIONAL && read_rational(t, off, &v, &num, &den)) {
+      snprintf(buf, sizeof(buf), "F%g", std::round(v * 10) / 10);
+      f->fnumber = buf;
+    } else if (tag == TAG_ISO && type == TIFF_SHORT) {
+      uint16_t iso;
+      if (read_u16(t, off, &iso)) f->iso = std::to_string(iso);
+    } else if (tag == TAG_DATETIME_ORIGINAL && type == TIFF_ASCII) {
+      f->datetime = read_ascii(t, off, count);
+    }
+  }
+}
+
+static std::vector<std::string> parse_tiff(const uint8_t *data, size_t size) {
+  std::vector<std::string> lines;
+  if (size < 8) return lines;
+
+  tiff_reader t = {data, size, false};
+  if (memcmp(data, "MM", 2) == 0) t.big_endian = true;
+  else if (memcmp(data, "II", 2) != 0) return lines;
+
+  uint16_t magic;
+  uint32_t ifd0;
+  if (!read_u16(t, 2, &magic) || magic != 42 || !read_u32(t, 4, &ifd0)) return lines;
+
+  exif_fields f = {};
+  parse_ifd(t, ifd0, &f);
+  if (f.exif_ifd && f.exif_ifd != ifd0) parse_ifd(t, f.exif_ifd, &f);
+
+  if (!f.make.empty()) lines.push_back("Make: " + f.make);
+  if (!f.model.empty()) lines.push_back("Model: " + f.model);
+  if (!f.exposure.empty()) lines.push_back("ExposureTime: " + f.exposure);
+  if (!f.fnumber.empty()) lines.push_back("FNumber: " + f.fnumber);
+  if (!f.iso.empty()) lines.push_back("ISOSpeedRatings: " + f.iso);
+  if (!f.datetime.empty()) lines.push_back("DateTimeOriginal: " + f.datetime);
+  return lines;
+}
+
+// Walk JPEG markers up to the first APP1 "Exif" segment; stops at start of scan
+static std::vector<uint8_t> find_jpeg_exif(FILE *fp) {
+  std::vector<uint8_t> seg;
+  while (true) {
+    int c = fgetc(fp);
+    if (c != 0xFF) return seg;
+    int marker;
+    do { marker = fgetc(fp); } while (marker == 0xFF);
+    if (marker == EOF || marker == 0xDA || marker == 0xD9) return seg;
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;
+
+    uint8_t len_bytes[2];
+    if (fread(len_bytes, 1, 2, fp) != 2) return seg;
+    size_t len = (len_bytes[0] << 8 | len_bytes[1]);
+    if (len < 2) return seg;
+    len -= 2;
+
+    if (marker == 0xE1 && len > 6) {
+      seg.resize(len);
+      if (fread(seg.data(), 1, len, fp) != len) return {};
+      if (memcmp(seg.data(), "Exif\0\0", 6) == 0) {
+        seg.erase(seg.begin(), seg.begin() + 6);
+        return seg;
+      }
+      seg.clear(); // XMP or another APP1 payload
+    } else if (fseek(fp, (long)len, SEEK_CUR) != 0) {
+      return seg;
+    }
+  }
+}
+
+// Walk PNG chunks up to the image data looking for eXIf
+static std::vector<uint8_t> find_png_exif(FILE *fp) {
+  std::vector<uint8_t> data;
+  uint8_t head[8];
+  while (fread(head, 1, 8, fp) == 8) {
+    uint32_t len = (uint32_t)head[0] << 24 | head[1] << 16 | head[2] << 8 | head[3];
+    if (memcmp(head + 4, "IDAT", 4) == 0 || memcmp(head + 4, "IEND", 4) == 0) break;
+    if (memcmp(head + 4, "eXIf", 4) == 0 && len <= (1 << 20)) {
+      data.resize(len);
+      if (fread(data.data(), 1, len, fp) != len) data.clear();
+      break;
+    }
+    if (fseek(fp, (long)len + 4, SEEK_CUR) != 0) break; // Data and CRC
+  }
+  return data;
+}
+
+std::vector<std::string> read_exif(const std::string &path) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp) return {};
+
+  uint8_t sig[8];
+  std::vector<uint8_t> tiff;
+  size_t n = fread(sig, 1, sizeof(sig), fp);
+  if (n >= 2 && sig[0] == 0xFF && sig[1] == 0xD8) {
+    fseek(fp, 2, SEEK_SET);
+    tiff = find_jpeg_exif(fp);
+  } else if (n == 8 && memcmp(sig, "\x89PNG\r\n\x1a\n", 8) == 0) {
+    tiff = find_png_exif(fp);
+  }
+  fclose(fp);
+
+  return parse_tiff(tiff.data(), tiff.size());
+}
@@ -0,0 +1,12 @@
+#ifndef EXIF_H
+#define EXIF_H
+
+#include <string>
+#include <vector>
+
+// Read the photographic EXIF fields (Make, Model, ExposureTime, FNumber,
+// ISOSpeedRatings, DateTimeOriginal) straight from a JPEG or PNG header.
+// Lines are formatted "Key: value". Returns an empty list if there is no EXIF.
+std::vector<std::string> read_exif(const std::string &path);
+
+#endif
@@ -0,0 +1,342 @@
+#include "gif.h"
+#include <gif_lib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Frames composited ahead of the one on screen
+static const size_t ring_capacity = 8;
+
+struct gif_stream {
+  std::string path;
+  GifFileType *gif;
+  int width, height;
+  std::vector<uint8_t> canvas; // The animation as composited so far
+  std::vector<uint8_t> saved;  // Canvas before the last frame, for DISPOSE_PREVIOUS
+
+  // While every frame draws from the global color map the canvas holds
+  // palette indices, a quarter of the size. The first frame that cannot be
+  // expressed that way switches it to ARGB32 for the rest of the pass.
+  bool indexed;
+  int clear_index; // Palette entry standing for transparent, -1 if none
+  std::shared_ptr<const std::vector<uint32_t>> palette;
+  GraphicsControlBlock gcb;     // Controls the frame about to be read
+  bool desc_read;               // The next frame's image descriptor is already read
+  int frames_read;
+
+  // Disposal owed by the previous frame
+  int prev_disposal;
+  int prev_left, prev_top, prev_width, prev_height;
+};
+
+static bool stream_open(gif_stream *s) {
+  int err;
+  s->gif = DGifOpenFileName(s->path.c_str(), &err);
+  if (!s->gif) return false;
+
+  s->width = s->gif->SWidth;
+  s->height = s->gif->SHeight;
+  if (s->width <= 0 || s->height <= 0) {
+    DGifCloseFile(s->gif, &err);
+    s->gif = nullptr;
+    return false;
+  }
+  // The canvas is set up once the first frame's transparency is known
+  s->canvas.clear();
+  s->saved.clear();
+  s->indexed = false;
+  s->desc_read = false;
+  s->frames_read = 0;
+  s->prev_disposal = DISPOSAL_UNSPECIFIED;
+  return true;
+}
+
+static void stream_close(gif_stream *s) {
+  int err;
+  if (s->gif) DGifCloseFile(s->gif, &err);
+  s->gif = nullptr;
+}
+
+// Read records up to the next image descriptor, picking up its graphics
+// control block. Returns false at the end of the file or on error.
+static bool seek_frame(gif_stream *s) {
+  if (s->desc_read) return true;
+
+  s->gcb = {DISPOSAL_UNSPECIFIED, false, 0, NO_TRANSPARENT_COLOR};
+  while (true) {
+    GifRecordType type;
+    if (DGifGetRecordType(s->gif, &type) == GIF_ERROR) return false;
+
+    if (type == IMAGE_DESC_RECORD_TYPE) {
+      if (DGifGetImageDesc(s->gif) == GIF_ERROR) return false;
+      s->desc_read = true;
+      return true;
+    } else if (type == EXTENSION_RECORD_TYPE) {
+      int code;
+      GifByteType *ext;
+      if (DGifGetExtension(s->gif, &code, &ext) == GIF_ERROR) return false;
+      if (code == GRAPHICS_EXT_FUNC_CODE && ext) DGifExtensionToGCB(ext[0], ext + 1, &s->gcb);
+      while (ext) {
+        if (DGifGetExtensionNext(s->gif, &ext) == GIF_ERROR) return false;
+      }
+    } else if (type == TERMINATE_RECORD_TYPE) {
+      return false;
+    }
+  }
+}
+
+// Start from transparent rather than the background color, as browsers do.
+// Indexed needs a transparent palette entry, which the first frame's
+// transparent color provides, unless that frame covers the whole canvas.
+static void start_canvas(gif_stream *s) {
+  const GifImageDesc &d = s->gif->Image;
+  ColorMapObject *cmap = s->gif->SColorMap;
+  bool covers = d.Left <= 0 && d.Top <= 0 && d.Left + d.Width >= s->width && d.Top + d.Height >= s->height;
+  s->clear_index = s->gcb.TransparentColor;
+  s->indexed = cmap && !d.ColorMap && (s->clear_index >= 0 || covers);
+
+  if (!s->indexed) {
+    s->canvas.assign((size_t)s->width * s->height * 4, 0);
+    return;
+  }
+
+  auto palette = std::make_shared<std::vector<uint32_t>>(256, 0);
+  for (int i = 0; i < std::min(cmap->ColorCount, 256); ++i) {
+    const GifColorType &col = cmap->Colors[i];
+    (*palette)[i] = 0xFF000000u | (uint32_t)col.Red << 16 | (uint32_t)col.Green << 8 | col.Blue;
+  }
+  if (s->clear_index >= 0) (*palette)[s->clear_index] = 0;
+  s->palette = palette;
+  s->canvas.assign((size_t)s->width * s->height, s->clear_index >= 0 ? s->clear_index : 0);
+}
+
+// Switch the canvas, and the copy kept for DISPOSE_PREVIOUS, to ARGB32
+static void demote_canvas(gif_stream *s) {
+  for (std::vector<uint8_t> *v : {&s->canvas, &s->saved}) {
+    std::vector<uint8_t> argb(v->size() * 4);
+    uint32_t *out = reinterpret_cast<uint32_t*>(argb.data());
+    for (size_t i = 0; i < v->size(); ++i) out[i] = (*s->palette)[(*v)[i]];
+    v->swap(argb);
+  }
+  s->indexed = false;
+}
+
+// Composite the next frame onto the canvas
+static bool read_frame(gif_stream *s, int *delay) {
+  if (!seek_frame(s)) return false;
+  s->desc_read = false;
+
+  const GifImageDesc &d = s->gif->Image;
+  ColorMapObject *cmap = d.ColorMap ? d.ColorMap : s->gif->SColorMap;
+  if (!cmap || d.Width <= 0 || d.Height <= 0) return false;
+  if (s->frames_read == 0) start_canvas(s);
+  if (s->indexed && d.ColorMap) demote_canvas(s);
+
+  // Undo the previous frame as it asked
+  if (s->prev_disposal == DISPOSE_BACKGROUND) {
+    if (s->indexed && s->clear_index < 0) demote_canvas(s);
+    int bpp = s->indexed ? 1 : 4;
+    int fill = s->indexed ? s->clear_index : 0;
+    for (int y = s->prev_top; y < s->prev_top + s->prev_height; ++y) {
+      memset(&s->canvas[((size_t)y * s->width + s->prev_left) * bpp], fill, (size_t)s->prev_width * bpp);
+    }
+  } else if (s->prev_disposal == DISPOSE_PREVIOUS && !s->saved.empty()) {
+    s->canvas = s->saved;
+  }
+  if (s->gcb.DisposalMode == DISPOSE_PREVIOUS) s->saved = s->canvas;
+
+  // Interlaced frames arrive in four passes of rows
+  static const int pass_start[] = {0, 4, 2, 1};
+  static const int pass_step[] = {8, 8, 4, 2};
+  int passes = d.Interlace ? 4 : 1;
+
+  std::vector<GifPixelType> line(d.Width);
+  for (int pass = 0; pass < passes; ++pass) {
+    int start = d.Interlace ? pass_start[pass] : 0;
+    int step = d.Interlace ? pass_step[pass] : 1;
+    for (int y = start; y < d.Height; y += step) {
+      if (DGifGetLine(s->gif, line.data(), d.Width) == GIF_ERROR) return false;
+
+      int cy = d.Top + y;
+      if (cy < 0 || cy >= s->height) continue;
+      size_t row = (size_t)cy * s->width;
+      for (int x = 0; x < d.Width; ++x) {
+        int cx = d.Left + x;
+        int c = line[x];
+        if (cx < 0 || cx >= s->width || c == s->gcb.TransparentColor) continue;
+        if (c >= cmap->ColorCount) continue;
+        // A later frame drawing the first frame's transparent entry opaquely
+        if (s->indexed && c == s->clear_index) demote_canvas(s);
+
+        if (s->indexed) {
+          s->canvas[row + cx] = c;
+        } else {
+          const GifColorType &col = cmap->Colors[c];
+          reinterpret_cast<uint32_t*>(s->canvas.data())[row + cx] =
+              0xFF000000u | (uint32_t)col.Red << 16 | (uint32_t)col.Green << 8 | col.Blue;
+        }
+      }
+    }
+  }
+
+  // Remember the disposal, clipped to the canvas
+  s->prev_disposal = s->gcb.DisposalMode;
+  s->prev_left = std::max(0, d.Left);
+  s->prev_top = std::max(0, d.Top);
+  s->prev_width = std::max(0, std::min(s->width, d.Left + d.Width) - s->prev_left);
+  s->prev_height = std::max(0, std::min(s->height, d.Top + d.Height) - s->prev_top);
+
+  // Like browsers, treat delays of 0 or 1 centiseconds as 100ms
+  *delay = (s->gcb.DelayTime <= 1) ? 100 : s->gcb.DelayTime * 10;
+  s->frames_read++;
+  return true;
+}
+
+// Next frame, rewinding to the first one after the last
+static bool stream_next(gif_stream *s, int *delay) {
+  if (read_frame(s, delay)) return true;
+  if (s->frames_read == 0) return false;
+
+  stream_close(s);
+  return stream_open(s) && read_frame(s, delay);
+}
+
+static PixelBufferRef snapshot(const gif_stream &s) {
+  auto frame = std::make_shared<PixelBuffer>();
+  frame->width = s.width;
+  frame->height = s.height;
+  frame->format = s.indexed ? PIXEL_INDEXED8 : PIXEL_ARGB32;
+  frame->data = s.canvas;
+  if (s.indexed) frame->palette = s.palette;
+  return frame;
+}
+
+bool decode_gif(const std::string &path, CachedImage *out, const std::atomic<bool> *cancelled) {
+  gif_stream s = {};
+  s.path = path;
+  if (!stream_open(&s)) return false;
+
+  int delay;
+  bool ok = read_frame(&s, &delay) && !(cancelled && cancelled->load());
+  if (ok) {
+    out->width = out->frame_width = s.width;
+    out->height = out->frame_height = s.height;
+    out->has_alpha = true;
+    out->frames.push_back(snapshot(s));
+    out->delays.push_back(delay);
+    // Only the first frame is cached; the rest stream through a gif_player
+    out->animated = seek_frame(&s);
+  }
+  stream_close(&s);
+  return ok;
+}
+
+static void player_main(struct gif_player *player) {
+  gif_stream s = {};
+  s.path = player->path;
+  if (!stream_open(&s)) return;
+
+  bool skip = true; // The first frame is already on screen from the cache
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(player->mutex);
+      player->space_cv.wait(lock, [player] { return player->stopping || player->ring.size() < ring_capacity; });
+      if (player->stopping) break;
+    }
+
+    int delay;
+    if (!stream_next(&s, &delay)) break;
+    if (skip) {
+      skip = false;
+      continue;
+    }
+
+    gif_frame frame = {snapshot(s), delay};
+    bool was_empty;
+    {
+      std::lock_guard<std::mutex> lock(player->mutex);
+      was_empty = player->ring.empty();
+      player->ring.push_back(std::move(frame));
+    }
+    if (was_empty) {
+      uint64_t one = 1;
+      if (write(player->wake_fd, &one, sizeof(one)) < 0) {
+        // Counter overflow is the only failure; the fd is already readable
+      }
+    }
+  }
+  stream_close(&s);
+}
+
+struct gif_player *gif_player_start(size_t index, const std::string &path, int first_delay, int wake_fd) {
+  struct gif_player *player = new gif_player();
+  player->index = index;
+  player->path = path;
+  player->stopping = false;
+  player->wake_fd = wake_fd;
+  player->shown_delay = first_delay;
+  player->shown_at = std::chrono::steady_clock::now();
+  player->thread = std::thread(player_main, player);
+  return player;
+}
+
+void gif_player_stop(struct gif_player *player) {
+  {
+    std::lock_guard<std::mutex> lock(player->mutex);
+    player->stopping = true;
+  }
+  player->space_cv.notify_all();
+  player->thread.join();
+  delete player;
+}
+
+// When the shown frame should give way to the next. With presentation
+// timing that is the commit deadline for the vblank closest to the next
+// frame's nominal time, so every frame is shown within one refresh of it;
+// without, it is the nominal time itself.
+static std::chrono::steady_clock::time_point next_commit_time(const struct gif_player *player,
+                                                              const present_timing &timing) {
+  auto nominal = player->shown_at + std::chrono::milliseconds(player->shown_delay);
+  if (!timing.valid || timing.refresh <= 0) return nominal;
+
+  int64_t target = std::chrono::duration_cast<std::chrono::nanoseconds>(nominal.time_since_epoch()).count();
+  int64_t vblank = timing.vblank + std::llround((double)(target - timing.vblank) / timing.refresh) * timing.refresh;
+  return std::chrono::steady_clock::time_point(
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(vblank - timing.latency)));
+}
+
+bool gif_player_tick(struct gif_player *player, const present_timing &timing,
+                     std::chrono::steady_clock::time_point *next) {
+  auto now = std::chrono::steady_clock::now();
+  auto due = next_commit_time(player, timing);
+  if (now < due) {
+    *next = due;
+    return false;
+  }
+
+  gif_frame frame;
+  {
+    std::lock_guard<std::mutex> lock(player->mutex);
+    if (player->ring.empty()) {
+      *next = std::chrono::steady_clock::time_point::max();
+      return false;
+    }
+    frame = std::move(player->ring.front());
+    player->ring.pop_front();
+  }
+  player->space_cv.notify_one();
+
+  // Keep the nominal schedule when slightly late; restart it after a stall
+  auto nominal = player->shown_at + std::chrono::milliseconds(player->shown_delay);
+  if (now - nominal < std::chrono::milliseconds(frame.delay)) {
+    player->shown_at = nominal;
+  } else {
+    player->shown_at = now;
+  }
+  player->shown = std::move(frame.pixels);
+  player->shown_delay = frame.delay;
+
+  *next = next_commit_time(player, timing);
+  return true;
+}
@@ -0,0 +1,53 @@
+#ifndef GIF_H
+#define GIF_H
+
+#include "app.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Decode the first frame of a GIF into `out` and flag whether more follow.
+// Returns false if giflib cannot read the file or `cancelled` gets set.
+bool decode_gif(const std::string &path, CachedImage *out, const std::atomic<bool> *cancelled);
+
+struct gif_stream;
+
+struct gif_frame {
+  PixelBufferRef pixels;
+  int delay; // in milliseconds
+};
+
+// Plays one animated GIF. A worker thread composites frames ahead of time
+// into a small ring, looping forever, so a long animation never needs all
+// of its frames in memory.
+struct gif_player {
+  size_t index; // Image being played
+  std::string path;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable space_cv; // Wakes the worker when the ring has room
+  std::deque<gif_frame> ring;
+  bool stopping;
+  int wake_fd; // The event loop's eventfd, signalled when a frame lands in an empty ring
+
+  // Wayland thread only
+  PixelBufferRef shown; // nullptr while the cached first frame is on screen
+  int shown_delay;
+  std::chrono::steady_clock::time_point shown_at; // When it was due on screen
+};
+
+struct gif_player *gif_player_start(size_t index, const std::string &path, int first_delay, int wake_fd);
+void gif_player_stop(struct gif_player *player);
+
+// Advance to the next frame if the shown one has been up for its delay.
+// With `timing` from wp_presentation, a frame is due early enough to be
+// committed for the vblank nearest its nominal time. Returns true if the
+// shown frame changed. `*next` receives when the next frame is due, or
+// time_point::max() if it is due but not decoded yet (wake_fd fires when
+// it is).
+bool gif_player_tick(struct gif_player *player, const present_timing &timing,
+                     std::chrono::steady_clock::time_point *next);
+
+#endif
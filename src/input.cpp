@@ -5,6 +5,7 @@
 #include <cstdio>
 #include <cstring>
 #include <algorithm>
+#include <cmath>
 
 static void pinch_begin(void *data, struct zwp_pointer_gesture_pinch_v1 *pinch, uint32_t serial, uint32_t time, struct wl_surface *surface, uint32_t fingers) {
   (void)pinch; (void)serial; (void)time; (void)surface; (void)fingers;
@@ -13,6 +14,7 @@ static void pinch_begin(void *data, struct zwp_pointer_gesture_pinch_v1 *pinch,
 }
 
 static void redraw(struct app_state *app) {
+  damage_all(app);
   app->redraw_pending = true;
   app->needs_hq_update = true;
   app->last_interaction_time = std::chrono::steady_clock::now();
@@ -86,7 +88,8 @@ static void keyboard_key(void *data, struct wl_keyboard *keyboard, uint32_t seri
       }
     } else if (key == KEY_I) {
       app->show_info = !app->show_info;
-      redraw(app);
+      loader_schedule(app);
+      app->overlays_pending = true;
     } else if (key == KEY_F) {
       app->fullscreen = !app->fullscreen;
       if (app->fullscreen) {
@@ -114,11 +117,79 @@ static const struct wl_keyboard_listener keyboard_listener = {
   .repeat_info = [](void*, struct wl_keyboard*, int32_t, int32_t) {},
 };
 
+// Pointer events arrive in groups ended by wl_pointer.frame, and a fast
+// mouse sends hundreds of them per second. They are collected here and
+// applied once per group.
+static void pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time, wl_fixed_t surface_x, wl_fixed_t surface_y) {
+  (void)pointer; (void)time;
+  struct app_state *app = static_cast<struct app_state*>(data);
+  struct pointer_input *in = &app->pointer_input;
+  if (!in->moved) in->start_y = app->mouse_y;
+  in->moved = true;
+  // Kept current right away for hit tests of a button in the same group
+  app->mouse_x = wl_fixed_to_double(surface_x);
+  app->mouse_y = wl_fixed_to_double(surface_y);
+}
+
+static void pointer_axis(void *data, struct wl_pointer *pointer, uint32_t time, uint32_t axis, wl_fixed_t value) {
+  (void)pointer; (void)time;
+  struct app_state *app = static_cast<struct app_state*>(data);
+  struct pointer_input *in = &app->pointer_input;
+  if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL) in->scroll_y += wl_fixed_to_double(value);
+  else if (axis == WL_POINTER_AXIS_HORIZONTAL_SCROLL) in->scroll_x += wl_fixed_to_double(value);
+}
+
+// Apply the motion and scrolling collected since the last group
+static void apply_pointer_input(struct app_state *app) {
+  struct pointer_input *in = &app->pointer_input;
+  bool changed = false;
+
+  if (in->moved && app->is_panning) {
+    app->pan_x += (app->mouse_x - app->last_mouse_x);
+    app->pan_y += (app->mouse_y - app->last_mouse_y);
+    app->last_mouse_x = app->mouse_x;
+    app->last_mouse_y = app->mouse_y;
+    changed = true;
+  } else if (in->moved) {
+    // Throttling: only update the overlays if the mouse crossed the tray area
+    int tray_h = 60; // Approximate tray area height at bottom
+    bool was_near_bottom = (in->start_y > app->height - tray_h);
+    bool is_near_bottom = (app->mouse_y > app->height - tray_h);
+    if (was_near_bottom != is_near_bottom) app->overlays_pending = true;
+  }
+
+  if (in->scroll_y != 0) {
+    if (app->modifiers & (1 << 0)) { // Shift + Scroll = Zoom
+        // 10% per wheel notch of 10 units, so a fast wheel or a touchpad
+        // zooms by all it scrolled in the group
+        float step = std::pow(1.1f, (float)(-in->scroll_y / 10));
+        app->zoom = std::clamp(app->zoom * step, 0.1f, 10.0f);
+    } else {
+        app->pan_y -= in->scroll_y;
+    }
+    changed = true;
+  }
+  if (in->scroll_x != 0) {
+    app->pan_x -= in->scroll_x;
+    changed = true;
+  }
+
+  *in = {};
+  if (changed) redraw(app);
+}
+
+static void pointer_frame(void *data, struct wl_pointer *pointer) {
+  (void)pointer;
+  apply_pointer_input(static_cast<struct app_state*>(data));
+}
+
 // Pointer handler for mouse clicks, tray UI, and panning
 static void pointer_button(void *data, struct wl_pointer *pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state) {
   (void)pointer; (void)serial; (void)time;
   struct app_state *app = static_cast<struct app_state*>(data);
   bool pressed = (state == WL_POINTER_BUTTON_STATE_PRESSED);
+  // Motion before the button in the same group still pans
+  apply_pointer_input(app);
 
   if (button == BTN_LEFT) {
     int btn_w = 40, btn_h = 40, spacing = 20;
@@ -142,7 +213,8 @@ static void pointer_button(void *data, struct wl_pointer *pointer, uint32_t seri
             load_image(app, (app->current_index + app->images.size() - 1) % app->images.size());
           } else if (app->mouse_x >= start_x + btn_w + spacing && app->mouse_x <= start_x + 2 * btn_w + spacing) {
             app->show_info = !app->show_info;
-            redraw(app);
+            loader_schedule(app);
+            app->overlays_pending = true;
           } else if (app->mouse_x >= start_x + 2 * (btn_w + spacing) && app->mouse_x <= start_x + 3 * btn_w + 2 * spacing) {
             app->pan_x = app->pan_y = 0;
             load_image(app, (app->current_index + 1) % app->images.size());
@@ -156,68 +228,18 @@ static void pointer_button(void *data, struct wl_pointer *pointer, uint32_t seri
       }
     } else {
       app->is_panning = false;
+      app->overlays_pending = true; // The tray hides while panning
     }
   }
 }
 
-static void pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time, wl_fixed_t surface_x, wl_fixed_t surface_y) {
-  (void)pointer; (void)time;
-  struct app_state *app = static_cast<struct app_state*>(data);
-  double old_y = app->mouse_y;
-  app->mouse_x = wl_fixed_to_double(surface_x);
-  app->mouse_y = wl_fixed_to_double(surface_y);
-
-  // Throttling: only redraw if panning or if mouse crosses UI tray area
-  int tray_h = 60; // Approximate tray area height at bottom
-  bool redraw_needed = app->is_panning;
-  
-  if (!redraw_needed) {
-      // Check if mouse entered or left the potential tray area
-      bool was_near_bottom = (old_y > app->height - tray_h);
-      bool is_near_bottom = (app->mouse_y > app->height - tray_h);
-      if (was_near_bottom != is_near_bottom) redraw_needed = true;
-  }
-
-  if (app->is_panning) {
-    app->pan_x += (app->mouse_x - app->last_mouse_x);
-    app->pan_y += (app->mouse_y - app->last_mouse_y);
-    app->last_mouse_x = app->mouse_x;
-    app->last_mouse_y = app->mouse_y;
-  }
-
-  if (redraw_needed) redraw(app);
-}
-
-static void pointer_axis(void *data, struct wl_pointer *pointer, uint32_t time, uint32_t axis, wl_fixed_t value) {
-  (void)pointer; (void)time;
-  struct app_state *app = static_cast<struct app_state*>(data);
-  double v = wl_fixed_to_double(value);
-  
-  if (app->modifiers & (1 << 0)) { // Shift for zooming maybe? Or just use wheel
-      // Keep wheel for zoom if preferred, but user wants panning
-  }
-
-  if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL) {
-    if (app->modifiers & (1 << 0)) { // Shift + Scroll = Zoom
-        if (v < 0) app->zoom = std::min(app->zoom * 1.1f, 10.0f);
-        else app->zoom = std::max(app->zoom * 0.9f, 0.1f);
-    } else {
-        app->pan_y -= v;
-    }
-    redraw(app);
-  } else if (axis == WL_POINTER_AXIS_HORIZONTAL_SCROLL) {
-    app->pan_x -= v;
-    redraw(app);
-  }
-}
-
 static const struct wl_pointer_listener pointer_listener = {
   .enter = [](void*, struct wl_pointer*, uint32_t, struct wl_surface*, wl_fixed_t, wl_fixed_t) {},
   .leave = [](void*, struct wl_pointer*, uint32_t, struct wl_surface*) {},
   .motion = pointer_motion,
   .button = pointer_button,
   .axis = pointer_axis,
-  .frame = [](void*, struct wl_pointer*) {},
+  .frame = pointer_frame,
   .axis_source = [](void*, struct wl_pointer*, uint32_t) {},
   .axis_stop = [](void*, struct wl_pointer*, uint32_t, uint32_t) {},
   .axis_discrete = [](void*, struct wl_pointer*, uint32_t, int32_t) {},
@@ -0,0 +1,128 @@
+#include "jpeg.h"
+#include "pixels.h"
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+
+struct jpeg_error {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+  jpeg_error *err = reinterpret_cast<jpeg_error*>(cinfo->err);
+  longjmp(err->jump, 1);
+}
+
+// Corrupt-data warnings are not worth a line on stderr per image
+static void jpeg_output_message(j_common_ptr) {}
+
+// Largest denominator in 1, 2, 4, 8 that keeps the fitted image at least
+// as large as the target box
+static unsigned int pick_scale_denom(int w, int h, int target_w, int target_h) {
+  if (target_w <= 0 || target_h <= 0) return 1;
+  double fit = std::min((double)target_w / w, (double)target_h / h);
+  unsigned int denom = 1;
+  while (denom < 8 && fit * denom * 2 <= 1.0) denom *= 2;
+  return denom;
+}
+
+// Kept free of C++ objects with destructors, since errors longjmp out of libjpeg
+static bool read_jpeg(FILE *fp, int target_w, int target_h, std::vector<uint8_t> *pixels, pixel_format *format,
+                      int *full_w, int *full_h, int *w, int *h, const std::atomic<bool> *cancelled) {
+  struct jpeg_decompress_struct cinfo;
+  jpeg_error err;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_error_exit;
+  err.mgr.output_message = jpeg_output_message;
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, fp);
+  jpeg_read_header(&cinfo, TRUE);
+
+  // CMYK and YCCK cannot be converted to BGRA; leave those to Imlib2
+  if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  *full_w = cinfo.image_width;
+  *full_h = cinfo.image_height;
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = pick_scale_denom(*full_w, *full_h, target_w, target_h);
+  // JPEGs are opaque, so skip the alpha byte: grayscale stays one byte
+  // per pixel and color is packed BGR, which expands to ARGB32 at draw time
+  if (cinfo.jpeg_color_space == JCS_GRAYSCALE) {
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    *format = PIXEL_GRAY8;
+  } else {
+    cinfo.out_color_space = JCS_EXT_BGR;
+    *format = PIXEL_RGB24;
+  }
+
+  jpeg_start_decompress(&cinfo);
+  *w = cinfo.output_width;
+  *h = cinfo.output_height;
+  size_t stride = (size_t)*w * cinfo.output_components;
+  pixels->resize(stride * *h);
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    if (cancelled && cancelled->load()) {
+      jpeg_destroy_decompress(&cinfo);
+      return false;
+    }
+
+    // Several rows per call keeps libjpeg's row buffers busy
+    JSAMPROW rows[16];
+    unsigned int n = 0;
+    for (; n < 16 && cinfo.output_scanline + n < cinfo.output_height; ++n) {
+      rows[n] = pixels->data() + (cinfo.output_scanline + n) * stride;
+    }
+    jpeg_read_scanlines(&cinfo, rows, n);
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+bool decode_jpeg(const std::string &path, int target_w, int target_h, CachedImage *out,
+                 const std::atomic<bool> *cancelled) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp) return false;
+
+  unsigned char magic[2];
+  if (fread(magic, 1, 2, fp) != 2 || magic[0] != 0xFF || magic[1] != 0xD8) {
+    fclose(fp);
+    return false;
+  }
+  rewind(fp);
+
+  std::vector<uint8_t> pixels;
+  pixel_format format;
+  int full_w, full_h, w, h;
+  bool ok = read_jpeg(fp, target_w, target_h, &pixels, &format, &full_w, &full_h, &w, &h, cancelled);
+  fclose(fp);
+  if (!ok) return false;
+
+  out->width = full_w;
+  out->height = full_h;
+  out->frame_width = w;
+  out->frame_height = h;
+  out->has_alpha = false;
+  auto frame = std::make_shared<PixelBuffer>();
+  frame->width = w;
+  frame->height = h;
+  frame->format = format;
+  frame->data = std::move(pixels);
+  tile_large_buffer(frame.get());
+  out->frames.push_back(std::move(frame));
+  out->delays.push_back(0);
+  return true;
+}
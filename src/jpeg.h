@@ -0,0 +1,15 @@
+#ifndef JPEG_H
+#define JPEG_H
+
+#include "app.h"
+#include <atomic>
+
+// Decode a JPEG with libjpeg-turbo, using DCT-domain downscaling to the
+// smallest power-of-two scale (1/1 to 1/8) that still covers a box of
+// target_w x target_h when fitted. A zero target decodes at full size.
+// Returns false if the file is not a JPEG libjpeg can convert to ARGB,
+// so the caller can fall back to Imlib2, or if `cancelled` gets set.
+bool decode_jpeg(const std::string &path, int target_w, int target_h, CachedImage *out,
+                 const std::atomic<bool> *cancelled);
+
+#endif
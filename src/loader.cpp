@@ -1,117 +1,350 @@
 #include "loader.h"
 #include <Imlib2.h>
 #include "renderer.h"
+#include "decoder.h"
+#include "cache.h"
+#include "exif.h"
+#include "jpeg.h"
+#include "gif.h"
+#include "loop.h"
+#include "pixels.h"
 #include <dirent.h>
 #include <unistd.h>
 #include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <cmath>
 
-void load_image(struct app_state *app, size_t index) {
-  if (index >= app->images.size()) return;
+std::mutex imlib_mutex;
 
-  app->current_index = index;
-  app->current_frame_index = 0;
-  app->last_frame_time = std::chrono::steady_clock::now();
-
-  int window = 3;
-  int start = (int)index - window;
-  int end = (int)index + window;
-
-  // Unload images outside window
-  for (auto it = app->cache.begin(); it != app->cache.end(); ) {
-      if ((int)it->first < start || (int)it->first > end) {
-          for (Imlib_Image f : it->second.frames) {
-              imlib_context_set_image(f);
-              imlib_free_image();
-          }
-          it = app->cache.erase(it);
-      } else {
-          ++it;
-      }
+// Cancel flag of the decode running on this thread, polled by Imlib2's progress hook
+static thread_local const std::atomic<bool> *decode_cancelled;
+
+static int decode_progress(Imlib_Image im, char percent, int update_x, int update_y, int update_w, int update_h) {
+  (void)im; (void)percent; (void)update_x; (void)update_y; (void)update_w; (void)update_h;
+  // Returning 0 makes Imlib2 abort the load
+  return (decode_cancelled && decode_cancelled->load()) ? 0 : 1;
+}
+
+// Imlib2 hands out straight alpha; Cairo and the resampler blend
+// premultiplied pixels
+static void premultiply(uint32_t *px, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t p = px[i], a = p >> 24;
+    if (a == 255) continue;
+    uint32_t r = ((p >> 16) & 0xFF) * a, g = ((p >> 8) & 0xFF) * a, b = (p & 0xFF) * a;
+    // x / 255, rounded, without a division
+    r = (r + 128 + ((r + 128) >> 8)) >> 8;
+    g = (g + 128 + ((g + 128) >> 8)) >> 8;
+    b = (b + 128 + ((b + 128) >> 8)) >> 8;
+    px[i] = (a << 24) | (r << 16) | (g << 8) | b;
   }
+}
+
+bool decode_image(const std::string &path, int target_w, int target_h, CachedImage *out,
+                  const std::atomic<bool> *cancelled) {
+  // libjpeg and giflib are thread-safe, so these formats skip Imlib2.
+  // libjpeg can also downscale while decoding.
+  if (decode_jpeg(path, target_w, target_h, out, cancelled)) return true;
+  if (cancelled && cancelled->load()) return false;
+  if (decode_gif(path, out, cancelled)) return true;
+  if (cancelled && cancelled->load()) return false;
 
-  // Helper to load any single image or GIF
-  auto perform_load = [&](size_t idx) -> bool {
-      if (app->cache.find(idx) != app->cache.end()) return true;
+  std::vector<uint32_t> argb;
+  int w, h;
+  {
+      // Imlib2 keeps its context in globals, so only one thread may use it at a time
+      std::lock_guard<std::mutex> lock(imlib_mutex);
+      if (cancelled && cancelled->load()) return false;
 
-      std::string path = app->images[idx];
+      decode_cancelled = cancelled;
+      imlib_context_set_progress_function(decode_progress);
+      imlib_context_set_progress_granularity(10);
       Imlib_Image img = imlib_load_image(path.c_str());
+      imlib_context_set_progress_function(nullptr);
+      decode_cancelled = nullptr;
       if (!img) return false;
 
       imlib_context_set_image(img);
-      int w = imlib_image_get_width();
-      int h = imlib_image_get_height();
-
-      CachedImage ci = {};
-      ci.width = w;
-      ci.height = h;
-
-      // Store the Imlib_Image directly
-      ci.frames.push_back(img);
-      ci.delays.push_back(0);
-      
-      // Do not free img here, we cache it
-
-      // Extract EXIF metadata once during load
-
-      // Extract EXIF metadata once during load
-      if (!ci.frames.empty()) {
-          std::string cmd = "exiv2 -pt \"" + path + "\" 2>/dev/null";
-          FILE *fp = popen(cmd.c_str(), "r");
-          if (fp) {
-              char buf[512];
-              while (fgets(buf, sizeof(buf), fp)) {
-                  std::string line(buf);
-                  if (line.find("Make") != std::string::npos || 
-                      line.find("Model") != std::string::npos || 
-                      line.find("ExposureTime") != std::string::npos || 
-                      line.find("FNumber") != std::string::npos || 
-                      line.find("ISOSpeedRatings") != std::string::npos ||
-                      line.find("DateTimeOriginal") != std::string::npos) {
-                      
-                      int spaces = 0;
-                      size_t val_pos = 0;
-                      for(size_t i=0; i<line.length(); ++i) {
-                          if (isspace(line[i])) {
-                              while(i < line.length() && isspace(line[i])) i++;
-                              spaces++;
-                              if (spaces == 3) { val_pos = i; break; }
-                              i--;
-                          }
-                      }
-
-                      if (val_pos > 0) {
-                          std::string key = line.substr(0, line.find(" "));
-                          size_t dot = key.find_last_of('.');
-                          if (dot != std::string::npos) key = key.substr(dot + 1);
-                          std::string val = line.substr(val_pos);
-                          if (!val.empty() && val.back() == '\n') val.pop_back();
-                          ci.exif_data.push_back(key + ": " + val);
-                      }
-                  }
-              }
-              pclose(fp);
-          }
-          if (ci.exif_data.empty()) {
-              ci.exif_data.push_back("No photographic EXIF data found");
-          }
+      w = imlib_image_get_width();
+      h = imlib_image_get_height();
+      const uint32_t *data = imlib_image_get_data_for_reading_only();
+      if (!data || (cancelled && cancelled->load())) {
+          imlib_free_image_and_decache();
+          return false;
+      }
+
+      out->width = out->frame_width = w;
+      out->height = out->frame_height = h;
+      out->has_alpha = imlib_image_has_alpha();
+
+      // Copy the pixels out so the renderer never has to touch Imlib2
+      argb.assign(data, data + (size_t)w * h);
+      imlib_free_image_and_decache();
+  }
+  if (cancelled && cancelled->load()) return false;
+  if (out->has_alpha) premultiply(argb.data(), argb.size());
+
+  // Scanned pages and screenshots often fit a gray or palette format
+  // at a quarter of the size; find out without holding the lock
+  out->frames.push_back(make_compact_buffer(w, h, argb.data(), out->has_alpha));
+  out->delays.push_back(0);
+  return true;
+}
+
+bool decode_metadata(const std::string &path, CachedImage *out) {
+  out->exif_data = read_exif(path);
+  if (out->exif_data.empty()) {
+      out->exif_data.push_back("No photographic EXIF data found");
+  }
+  return true;
+}
+
+// Neighbor slots shared between ahead and behind; the same memory as a
+// symmetric +-3 window
+static const int prefetch_slots = 6;
+
+int loader_plan_rank(struct app_state *app, size_t index) {
+  const std::vector<size_t> &plan = app->prefetch_plan;
+  auto it = std::find(plan.begin(), plan.end(), index);
+  return (it == plan.end()) ? -1 : (int)(it - plan.begin());
+}
+
+// Fold one navigation step into the direction and speed estimates
+static void record_step(struct app_state *app, size_t index) {
+  size_t n = app->images.size();
+  int dir;
+  // Stepping past either end wraps around, so compare modulo the list size
+  if (index == (app->current_index + 1) % n) dir = 1;
+  else if (index == (app->current_index + n - 1) % n) dir = -1;
+  else if (index != app->current_index) dir = (index > app->current_index) ? 1 : -1;
+  else return;
+
+  auto now = std::chrono::steady_clock::now();
+  float dt = std::chrono::duration<float>(now - app->last_nav_time).count();
+  app->last_nav_time = now;
+
+  // History fades after a pause: every 10s halves the weight past steps
+  // keep, from 70% for quick steps to 35% after 10s
+  float keep = 0.7f * std::exp2(-dt / 10.0f);
+  app->nav_bias = app->nav_bias * keep + dir * (1.0f - keep);
+  app->nav_rate = app->nav_rate * 0.7f + std::min(1.0f / std::max(dt, 0.01f), 20.0f) * 0.3f;
+  app->travel_dir = dir;
+}
+
+// Pick the neighbors worth keeping, spending more slots in the direction the
+// user has been travelling, until the estimated decoded size would overflow
+// the cache budget. Plan order is decode priority.
+static void plan_prefetch(struct app_state *app, size_t index) {
+  app->prefetch_plan.clear();
+  app->prefetch_plan.push_back(index);
+
+  int ahead_dir = (app->nav_bias > 0.05f) ? 1 : (app->nav_bias < -0.05f) ? -1 : app->travel_dir;
+
+  // Keep at least one image behind for the odd step back. Skimming faster
+  // than two images a second means the user is committed to a direction.
+  int behind = (int)std::lround(prefetch_slots * (1.0f - std::fabs(app->nav_bias)) / 2.0f);
+  if (app->nav_rate > 2.0f) behind = 1;
+  behind = std::clamp(behind, 1, prefetch_slots / 2);
+  int ahead = prefetch_slots - behind;
 
-          app->cache[idx] = ci;
-          return true;
+  size_t estimate = cache_estimate_bytes(app);
+  auto cur = app->cache.find(index);
+  size_t used = (cur != app->cache.end()) ? cur->second.bytes : estimate;
+
+  // At equal distance the image ahead comes first
+  for (int dist = 1; dist <= ahead; ++dist) {
+      for (int sign : {ahead_dir, -ahead_dir}) {
+          if (sign != ahead_dir && dist > behind) continue;
+          int i = (int)index + sign * dist;
+          if (i < 0 || i >= (int)app->images.size()) continue;
+
+          auto it = app->cache.find((size_t)i);
+          size_t bytes = (it != app->cache.end()) ? it->second.bytes : estimate;
+          if (used + bytes > app->cache_budget) return;
+          used += bytes;
+          app->prefetch_plan.push_back((size_t)i);
       }
-      return false;
+  }
+}
+
+// Size of the image on screen relative to its decoded frames, at the current zoom
+static double display_scale(struct app_state *app, const CachedImage &img) {
+  if (app->width <= 0 || app->height <= 0) return 1.0;
+  double fit = std::min((double)app->width / img.width, (double)app->height / img.height);
+  return img.width * fit * app->zoom * app->buffer_scale / img.frame_width;
+}
+
+// Whether the decoded frames are too small for the current zoom
+static bool needs_full_resolution(struct app_state *app, const CachedImage &img) {
+  if (img.frame_width >= img.width) return false;
+  return display_scale(app, img) * img.frame_width > img.frame_width + 1;
+}
+
+// Whether the image is shown at half its frame size or less without a pyramid
+static bool needs_mipmaps(struct app_state *app, const CachedImage &img) {
+  if (img.animated || !img.mips.empty()) return false;
+  if (img.frame_width < 128 || img.frame_height < 128) return false;
+  return display_scale(app, img) <= 0.5;
+}
+
+void loader_schedule(struct app_state *app) {
+  // Decode to cover the output at the current zoom; before the first
+  // configure the output size is unknown, so decode at full size
+  float zoom = std::max(app->zoom, 1.0f);
+  int target_w = (int)(app->width * app->buffer_scale * zoom);
+  int target_h = (int)(app->height * app->buffer_scale * zoom);
+
+  auto job = [app](size_t i, decode_kind kind) {
+      decode_job j = {};
+      j.index = i;
+      j.kind = kind;
+      j.path = app->images[i];
+      return j;
   };
 
-  perform_load(index);
+  // Replacing the queue drops or cancels decodes the user has moved past,
+  // and the plan order puts the current image first. Nothing here blocks.
+  std::vector<decode_job> jobs;
+  for (size_t i : app->prefetch_plan) {
+      // A file that failed once would fail on every navigation step
+      if (app->decode_failed.count(i)) continue;
+      auto it = app->cache.find(i);
+      if (it == app->cache.end()) {
+          decode_job j = job(i, DECODE_PIXELS);
+          j.target_w = target_w;
+          j.target_h = target_h;
+          jobs.push_back(j);
+      } else if (i == app->current_index && needs_full_resolution(app, it->second)) {
+          // Zoomed past the scaled decode: replace it with the full image
+          jobs.insert(jobs.begin(), job(i, DECODE_PIXELS));
+      }
+  }
+
+  // Pyramids for the image on screen come right after its pixels; the
+  // neighbors' wait until all pixel decodes are done
+  for (size_t i : app->prefetch_plan) {
+      auto it = app->cache.find(i);
+      if (it == app->cache.end() || !needs_mipmaps(app, it->second)) continue;
+
+      decode_job j = job(i, DECODE_MIPMAPS);
+      j.source = it->second.frames[0];
+      if (i == app->current_index) jobs.insert(jobs.begin(), j);
+      else jobs.push_back(j);
+  }
+
+  // Metadata stays off the prefetch path: it jumps the queue only for the
+  // image on screen with the overlay open, and otherwise waits for idle workers
+  for (size_t i : app->prefetch_plan) {
+      auto it = app->cache.find(i);
+      if (it == app->cache.end() || it->second.exif_loaded) continue;
+
+      if (i == app->current_index && app->show_info) jobs.insert(jobs.begin(), job(i, DECODE_METADATA));
+      else jobs.push_back(job(i, DECODE_METADATA));
+  }
+  decoder_schedule(app->decoder, std::move(jobs));
+}
 
-  // Proactively load neighbors
-  for (int i = start; i <= end; ++i) {
-      if (i < 0 || i >= (int)app->images.size() || i == (int)index) continue;
-      perform_load((size_t)i);
+void loader_check_resolution(struct app_state *app) {
+  auto it = app->cache.find(app->current_index);
+  if (it == app->cache.end()) return;
+
+  size_t i = app->current_index;
+  if ((needs_full_resolution(app, it->second) && !decoder_is_pending(app->decoder, i, DECODE_PIXELS) &&
+       !app->decode_failed.count(i)) ||
+      (needs_mipmaps(app, it->second) && !decoder_is_pending(app->decoder, i, DECODE_MIPMAPS))) {
+      loader_schedule(app);
+  }
+}
+
+// Play the current image if it is animated, and only that one
+static void update_player(struct app_state *app) {
+  if (app->player && app->player->index != app->current_index) {
+      gif_player_stop(app->player);
+      app->player = nullptr;
+  }
+
+  auto it = app->cache.find(app->current_index);
+  if (!app->player && it != app->cache.end() && it->second.animated) {
+      app->player = gif_player_start(app->current_index, app->images[app->current_index], it->second.delays[0],
+                                     app->loop->wake_fd);
+  }
+}
+
+void load_image(struct app_state *app, size_t index) {
+  if (index >= app->images.size()) return;
+
+  record_step(app, index);
+  app->current_index = index;
+
+  if (app->cache.count(index)) app->cache_hits++;
+  else app->cache_misses++;
+  cache_touch(app, index);
+
+  plan_prefetch(app, index);
+  cache_evict(app);
+  update_player(app);
+
+  loader_schedule(app);
+
+  if (app->configured) {
+      damage_all(app);
+      app->redraw_pending = true;
+  }
+}
+
+void loader_collect(struct app_state *app) {
+  bool inserted = false;
+  for (decode_result &r : decoder_take_results(app->decoder)) {
+      if (!r.ok) {
+          // Cancelled decodes never get here, so this one is broken
+          if (r.kind == DECODE_PIXELS) app->decode_failed.insert(r.index);
+          continue;
+      }
+
+      if (r.kind == DECODE_METADATA) {
+          // The image may have been evicted meanwhile; it will be re-read on demand
+          auto it = app->cache.find(r.index);
+          if (it == app->cache.end()) continue;
+          it->second.exif_data = std::move(r.image.exif_data);
+          it->second.exif_loaded = true;
+          if (r.index == app->current_index && app->show_info) app->overlays_pending = true;
+          continue;
+      }
+
+      if (r.kind == DECODE_MIPMAPS) {
+          // Drop pyramids of a frame that has since been replaced or evicted
+          auto it = app->cache.find(r.index);
+          if (it == app->cache.end() || it->second.frames.empty() || it->second.frames[0] != r.source) continue;
+          it->second.mips = std::move(r.image.mips);
+          cache_update_bytes(app, r.index);
+          if (r.index == app->current_index && app->configured) {
+              damage_all(app);
+              app->redraw_pending = true;
+          }
+          continue;
+      }
+
+      // A full-resolution redecode keeps the metadata already read
+      auto old = app->cache.find(r.index);
+      if (old != app->cache.end() && old->second.exif_loaded) {
+          r.image.exif_data = std::move(old->second.exif_data);
+          r.image.exif_loaded = true;
+      }
+
+      // Stale results stay if there is room; eviction ranks them first
+      cache_insert(app, r.index, std::move(r.image));
+      inserted = true;
+      if (r.index == app->current_index && app->configured) {
+          damage_all(app);
+          app->redraw_pending = true;
+      }
   }
+  cache_evict(app);
+  update_player(app);
 
-  if (app->configured) app->redraw_pending = true;
+  // New entries may need metadata or mipmaps queued
+  if (inserted) loader_schedule(app);
 }
 
 void scan_directory(struct app_state *app, const char *filepath) {
@@ -135,6 +368,7 @@ void scan_directory(struct app_state *app, const char *filepath) {
   if (!dp) return;
 
   app->images.clear();
+  app->decode_failed.clear();
   struct dirent *entry;
   while ((entry = readdir(dp))) {
     std::string name = entry->d_name;
@@ -2,8 +2,28 @@
 #define LOADER_H
 
 #include "app.h"
+#include <atomic>
+#include <mutex>
 
+// Guards every Imlib2 call; its context is process-global
+extern std::mutex imlib_mutex;
+
+// Returns false on failure, or if `cancelled` gets set while decoding.
+// JPEGs may be decoded smaller, down to what covers target_w x target_h.
+bool decode_image(const std::string &path, int target_w, int target_h, CachedImage *out,
+                  const std::atomic<bool> *cancelled);
+bool decode_metadata(const std::string &path, CachedImage *out);
 void load_image(struct app_state *app, size_t index);
+void loader_collect(struct app_state *app);
+
+// Re-queue decode and metadata jobs for the current plan, e.g. after show_info changes
+void loader_schedule(struct app_state *app);
+
+// Queue a full-resolution decode if zoom has outgrown a scaled JPEG decode,
+// or a mipmap build if the current image is shown at half size or less
+void loader_check_resolution(struct app_state *app);
+// Position in the prefetch plan (0 is the current image), or -1 if unplanned
+int loader_plan_rank(struct app_state *app, size_t index);
 void scan_directory(struct app_state *app, const char *filepath);
 
 #endif
@@ -0,0 +1,68 @@
+#include "loop.h"
+#include "app.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+struct event_loop *event_loop_create() {
+  struct event_loop *loop = new event_loop();
+  loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (loop->wake_fd == -1) die("eventfd failed");
+  // steady_clock reads CLOCK_MONOTONIC, so deadlines carry over as they are
+  loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (loop->timer_fd == -1) die("timerfd_create failed");
+  loop->armed = std::chrono::steady_clock::time_point::max();
+  return loop;
+}
+
+void event_loop_destroy(struct event_loop *loop) {
+  close(loop->wake_fd);
+  close(loop->timer_fd);
+  delete loop;
+}
+
+void event_loop_arm(struct event_loop *loop, std::chrono::steady_clock::time_point when) {
+  if (when == loop->armed) return;
+  loop->armed = when;
+
+  // An all-zero value disarms the timer
+  struct itimerspec spec = {};
+  if (when != std::chrono::steady_clock::time_point::max()) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+    // A deadline already past fires at once
+    if (ns <= 0) ns = 1;
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+  }
+  if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) die("timerfd_settime failed");
+}
+
+int event_loop_wait(struct event_loop *loop, int display_fd, bool busy) {
+  struct pollfd pfds[3] = {
+    { display_fd, POLLIN, 0 },
+    { loop->wake_fd, POLLIN, 0 },
+    { loop->timer_fd, POLLIN, 0 },
+  };
+  // EINTR just means nothing fired
+  if (poll(pfds, 3, busy ? 0 : -1) <= 0) return 0;
+
+  int fired = 0;
+  uint64_t count;
+  if (pfds[0].revents & POLLIN) fired |= LOOP_DISPLAY;
+  if (pfds[1].revents & POLLIN) {
+    fired |= LOOP_WAKE;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0) {
+      // EAGAIN: another reader drained it first
+    }
+  }
+  if (pfds[2].revents & POLLIN) {
+    fired |= LOOP_TIMER;
+    if (read(loop->timer_fd, &count, sizeof(count)) < 0) {
+      // EAGAIN: re-armed since it fired
+    }
+    // A one-shot timer disarms itself once it fires
+    loop->armed = std::chrono::steady_clock::time_point::max();
+  }
+  return fired;
+}
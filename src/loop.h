@@ -0,0 +1,34 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <chrono>
+
+// What the Wayland thread sleeps on besides the display: one eventfd that
+// every background worker signals when it finishes something, and a
+// timerfd armed for the nearest deadline, so both wake it on time instead
+// of being polled for
+struct event_loop {
+  int wake_fd;
+  int timer_fd;
+  std::chrono::steady_clock::time_point armed; // Deadline the timer is set for, max() if none
+};
+
+// What woke event_loop_wait()
+enum {
+  LOOP_DISPLAY = 1, // The display fd is readable
+  LOOP_WAKE = 2,    // A worker finished something
+  LOOP_TIMER = 4,   // The deadline passed
+};
+
+struct event_loop *event_loop_create();
+void event_loop_destroy(struct event_loop *loop);
+
+// Fire the timer at `when`, or never for time_point::max()
+void event_loop_arm(struct event_loop *loop, std::chrono::steady_clock::time_point when);
+
+// Wait until the display fd is readable, a worker signals or the timer
+// fires; with `busy`, only check. Drains the eventfd and the timerfd and
+// returns LOOP_* flags for what fired.
+int event_loop_wait(struct event_loop *loop, int display_fd, bool busy);
+
+#endif
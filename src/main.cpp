@@ -2,12 +2,19 @@
 #include "renderer.h"
 #include "loader.h"
 #include "input.h"
+#include "decoder.h"
+#include "gif.h"
+#include "workers.h"
+#include "refine.h"
+#include "present.h"
+#include "loop.h"
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <unistd.h>
-#include <poll.h>
 #include <algorithm>
+#include <cmath>
+#include <thread>
 
 void die(const char *msg) {
   fprintf(stderr, "%s\n", msg);
@@ -20,8 +27,18 @@ static void registry_handle_global(void *data, struct wl_registry *registry, uin
 
   if (strcmp(interface, wl_compositor_interface.name) == 0) {
     app->compositor = static_cast<struct wl_compositor*>(wl_registry_bind(registry, name, &wl_compositor_interface, 4));
+  } else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+    app->subcompositor = static_cast<struct wl_subcompositor*>(wl_registry_bind(registry, name, &wl_subcompositor_interface, 1));
   } else if (strcmp(interface, wl_shm_interface.name) == 0) {
     app->shm = static_cast<struct wl_shm*>(wl_registry_bind(registry, name, &wl_shm_interface, 1));
+  } else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+    app->viewporter = static_cast<struct wp_viewporter*>(wl_registry_bind(registry, name, &wp_viewporter_interface, 1));
+  } else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+    app->presentation = static_cast<struct wp_presentation*>(wl_registry_bind(registry, name, &wp_presentation_interface, 1));
+    present_init(app);
+  } else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+    app->fractional_scale_manager = static_cast<struct wp_fractional_scale_manager_v1*>(
+        wl_registry_bind(registry, name, &wp_fractional_scale_manager_v1_interface, 1));
   } else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
     app->xdg_wm_base = static_cast<struct xdg_wm_base*>(wl_registry_bind(registry, name, &xdg_wm_base_interface, 1));
     xdg_wm_base_add_listener(app->xdg_wm_base, &xdg_wm_base_listener, app);
@@ -38,10 +55,8 @@ static void registry_handle_global(void *data, struct wl_registry *registry, uin
         .done = [](void*, struct wl_output*) {},
         .scale = [](void *data, struct wl_output*, int32_t factor) {
             struct app_state *app = static_cast<struct app_state*>(data);
-            if (app->buffer_scale != factor) {
-                app->buffer_scale = factor;
-                app->redraw_pending = true;
-            }
+            app->output_scale = factor;
+            update_buffer_scale(app);
         },
     };
     wl_output_add_listener(output, &output_listener, app);
@@ -53,20 +68,54 @@ const struct wl_registry_listener registry_listener = {
   .global_remove = [](void*, struct wl_registry*, uint32_t) {},
 };
 
+// Compositors that scale by fractions, 1.5 say, would otherwise get a 2x
+// buffer from wl_output and downsample it. With this the window renders
+// exactly as many pixels as it covers, sized by its wp_viewport.
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+  .preferred_scale = [](void *data, struct wp_fractional_scale_v1*, uint32_t scale) {
+      struct app_state *app = static_cast<struct app_state*>(data);
+      app->preferred_scale = scale;
+      update_buffer_scale(app);
+  },
+};
+
 static void surface_frame_callback(void *data, struct wl_callback *callback, uint32_t time);
 
 static const struct wl_callback_listener frame_listener = {
   .done = surface_frame_callback
 };
 
+// The only place the main surface is drawn; otherwise it is only committed
+// bare to move an overlay. Every draw asks for a frame callback and nothing
+// is drawn while one is outstanding, so
+// input arriving faster than the display refreshes folds into the next
+// frame instead of drawing several per refresh.
+static void render_frame(struct app_state *app) {
+  if (!create_buffer(app)) return;
+  app->frame_callback = wl_surface_frame(app->surface);
+  wl_callback_add_listener(app->frame_callback, &frame_listener, app);
+  update_overlays(app);
+  present_feedback(app);
+  wl_surface_commit(app->surface);
+  app->redraw_pending = false;
+  app->overlays_moved = false;
+}
+
 static void surface_frame_callback(void *data, struct wl_callback *callback, uint32_t time) {
-  (void)time;
   struct app_state *app = static_cast<struct app_state*>(data);
   wl_callback_destroy(callback);
   app->frame_callback = nullptr;
 
-  // Rubber-band animation physics
-  float lerp_factor = 0.15f;
+  // Physics advances by the time since the previous frame of the same
+  // animation, so motion has the same speed at any refresh rate and when
+  // frames are dropped. The first frame takes one 60 Hz step; a stall
+  // counts for at most 100 ms so nothing jumps across the screen.
+  float dt = 1.0f / 60;
+  if (app->frame_time_valid) dt = std::min(time - app->frame_time, 100u) / 1000.0f;
+
+  // Rubber-band animation physics: rebounds close 15% of the gap and
+  // keyboard zoom grows 3% every 1/60 s
+  float lerp_factor = 1.0f - std::pow(1.0f - 0.15f, dt * 60);
   
   // 1. Zoom limits (0.05x to 10.0x)
   if (app->zoom < 0.05f) app->target_zoom = 0.05f;
@@ -111,7 +160,7 @@ static void surface_frame_callback(void *data, struct wl_callback *callback, uin
   }
 
   // Continuous Zoom Physics
-  float zoom_speed = 1.03f;
+  float zoom_speed = std::pow(1.03f, dt * 60);
   if (app->zooming_in) {
       app->zoom = std::min(app->zoom * zoom_speed, 15.0f);
       ui_animating = true;
@@ -123,27 +172,55 @@ static void surface_frame_callback(void *data, struct wl_callback *callback, uin
   
   app->is_animating = ui_animating;
   if (ui_animating) app->needs_hq_update = true;
+  app->frame_time = time;
+  app->frame_time_valid = ui_animating;
 
-  // Redraw if needed
-  if (app->redraw_pending || ui_animating) {
-    create_buffer(app);
-    wl_surface_set_buffer_scale(app->surface, app->buffer_scale);
-    wl_surface_attach(app->surface, app->buffer, 0, 0);
-    wl_surface_damage(app->surface, 0, 0, app->width, app->height);
-
-    // Always request next frame callback if UI interaction/physics/zooming is taking place
-    if (ui_animating || app->zooming_in || app->zooming_out) {
-      app->frame_callback = wl_surface_frame(app->surface);
-      wl_callback_add_listener(app->frame_callback, &frame_listener, app);
-    }
-    
-    wl_surface_commit(app->surface);
-    app->redraw_pending = false;
+  // Redraw if needed. With every buffer held, the main loop draws once one
+  // is released.
+  if (ui_animating) {
+    damage_all(app);
+    app->redraw_pending = true;
   }
+  if (app->redraw_pending) render_frame(app);
+}
+
+// The quality redraw waits until input has settled for 100 ms. Starts it
+// once due and returns when to check again, or time_point::max() if
+// nothing waits or input is still going on.
+static std::chrono::steady_clock::time_point hq_debounce(struct app_state *app) {
+  auto never = std::chrono::steady_clock::time_point::max();
+  if (!app->needs_hq_update) return never;
+  if (app->zooming_in || app->zooming_out || app->is_panning || app->is_animating) return never;
+
+  auto due = app->last_interaction_time + std::chrono::milliseconds(100);
+  if (std::chrono::steady_clock::now() < due) return due;
+  damage_all(app);
+  app->redraw_pending = true;
+  app->needs_hq_update = false;
+  return never;
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) die("Usage: fey <image_file/directory>");
+  const char *usage = "Usage: fey [--cache-mb N] [--render-threads N] <image_file/directory>";
+  const char *path = nullptr;
+  long cache_mb = 1024;
+  long render_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+      char *end;
+      cache_mb = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || cache_mb <= 0) die(usage);
+    } else if (strcmp(argv[i], "--render-threads") == 0 && i + 1 < argc) {
+      char *end;
+      render_threads = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || render_threads <= 0 || render_threads > 256) die(usage);
+    } else if (!path && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      die(usage);
+    }
+  }
+  if (!path) die(usage);
 
   struct app_state app = {};
   app.running = 1;
@@ -151,22 +228,36 @@ int main(int argc, char *argv[]) {
   app.target_zoom = 1.0f;
   app.pan_x = app.pan_y = 0;
   app.target_pan_x = app.target_pan_y = 0;
-  app.shm_fd = -1;
   app.configured = false;
   app.last_interaction_time = std::chrono::steady_clock::now();
   app.fullscreen = false;
+  app.cache_budget = (size_t)cache_mb * 1024 * 1024;
+  app.damage = cairo_region_create();
+  app.travel_dir = 1;
+  app.last_nav_time = std::chrono::steady_clock::now();
 
-  scan_directory(&app, argv[1]);
+  scan_directory(&app, path);
   if (app.images.empty()) die("No images found");
+
+  // Leave one core for the Wayland thread
+  int decode_threads = std::clamp((int)std::thread::hardware_concurrency() - 1, 1, 4);
+  app.loop = event_loop_create();
+  app.decoder = decoder_create(decode_threads, app.loop->wake_fd);
+  app.workers = worker_pool_create((int)render_threads);
+  app.refiner = refiner_create(app.loop->wake_fd);
   
+  // The window is sized from the first image, so this is the only decode we wait for
   load_image(&app, app.current_index);
+  decoder_wait(app.decoder, app.current_index);
+  loader_collect(&app);
   if (app.cache.count(app.current_index)) {
       app.width = app.cache[app.current_index].width;
       app.height = app.cache[app.current_index].height;
   } else {
       app.width = 800; app.height = 600; // Fallback
   }
-  app.buffer_scale = 1; // Default to 1, can be improved with output listeners
+  app.buffer_scale = 1; // Until wl_output or wp_fractional_scale_v1 says otherwise
+  app.output_scale = 1;
 
   app.display = wl_display_connect(NULL);
   if (!app.display) die("Cannot connect to Wayland display");
@@ -175,9 +266,17 @@ int main(int argc, char *argv[]) {
   wl_registry_add_listener(app.registry, &registry_listener, &app);
   wl_display_roundtrip(app.display);
 
-  if (!app.compositor || !app.shm || !app.xdg_wm_base) die("Missing required Wayland globals");
+  if (!app.compositor || !app.subcompositor || !app.shm || !app.xdg_wm_base) die("Missing required Wayland globals");
 
   app.surface = wl_compositor_create_surface(app.compositor);
+  if (app.fractional_scale_manager && app.viewporter) {
+    app.viewport = wp_viewporter_get_viewport(app.viewporter, app.surface);
+    app.fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(app.fractional_scale_manager, app.surface);
+    wp_fractional_scale_v1_add_listener(app.fractional_scale, &fractional_scale_listener, &app);
+  }
+  overlay_font_load(&app);
+  if (app.viewporter) scaled_view_init(&app);
+  overlays_init(&app);
   app.xdg_surface = xdg_wm_base_get_xdg_surface(app.xdg_wm_base, app.surface);
   xdg_surface_add_listener(app.xdg_surface, &xdg_surface_listener, &app);
   
@@ -191,36 +290,33 @@ int main(int argc, char *argv[]) {
 
   while (app.running) {
     // 1. GIF Animation Advancement (Independent of frame callback)
-    auto it_cache = app.cache.find(app.current_index);
-    if (it_cache != app.cache.end() && it_cache->second.frames.size() > 1) {
-      auto now = std::chrono::steady_clock::now();
-      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - app.last_frame_time).count();
-      int delay = it_cache->second.delays[app.current_frame_index % it_cache->second.frames.size()];
-      if (delay <= 0) delay = 100;
-
-      if (elapsed >= delay) {
-        app.current_frame_index = (app.current_frame_index + 1) % it_cache->second.frames.size();
-        app.last_frame_time = now;
-        app.redraw_pending = true;
-      }
+    auto gif_due = std::chrono::steady_clock::time_point::max();
+    if (app.player && gif_player_tick(app.player, app.timing, &gif_due)) {
+      damage_all(&app);
+      app.redraw_pending = true;
     }
 
-    // 2. Trigger Redraw if Ready (Only if no frame callback is pending)
-    if (app.redraw_pending && !app.frame_callback && app.configured) {
-        create_buffer(&app);
-        if (app.buffer) {
-            wl_surface_set_buffer_scale(app.surface, app.buffer_scale);
-            wl_surface_attach(app.surface, app.buffer, 0, 0);
-            wl_surface_damage(app.surface, 0, 0, app.width, app.height);
-            // If animation starts, frame callback will be set up in callback or here
-            if (app.zooming_in || app.zooming_out || std::abs(app.zoom - app.target_zoom) > 0.001f ||
-                std::abs(app.pan_x - app.target_pan_x) > 0.1f || std::abs(app.pan_y - app.target_pan_y) > 0.1f) {
-                app.frame_callback = wl_surface_frame(app.surface);
-                wl_callback_add_listener(app.frame_callback, &frame_listener, &app);
-            }
-            wl_surface_commit(app.surface);
+    // Zooming may have outgrown a scaled JPEG decode
+    loader_check_resolution(&app);
+
+    // The switch from the fast filter to the quality pass
+    auto hq_due = hq_debounce(&app);
+
+    // 2. Draw right away when no frame is in flight; otherwise the frame
+    // callback draws
+    if (app.redraw_pending && !app.frame_callback && !app.pool.starved && app.configured) {
+        render_frame(&app);
+    }
+
+    // 3. Overlay-only changes recommit just their own subsurface. A new
+    // position is parent state, so it also takes a commit of the image
+    // surface, with nothing attached.
+    if (app.overlays_pending && app.configured) {
+        update_overlays(&app);
+        if (app.overlays_moved) {
+          wl_surface_commit(app.surface);
+          app.overlays_moved = false;
         }
-        app.redraw_pending = false;
     }
 
     // 4. Preparation for reading display events
@@ -229,53 +325,32 @@ int main(int argc, char *argv[]) {
     }
     wl_display_flush(app.display);
 
-    // 5. Dynamic Poll Timeout
-    struct pollfd pfd = { display_fd, POLLIN, 0 };
-    int timeout = -1; // Wait forever unless we have an animation or pending redraw
-    
-    // Check if we need a timeout for the next GIF frame
-    if (it_cache != app.cache.end() && it_cache->second.frames.size() > 1) {
-        auto now = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - app.last_frame_time).count();
-        int delay = it_cache->second.delays[app.current_frame_index % it_cache->second.frames.size()];
-        if (delay <= 0) delay = 100;
-        timeout = std::max(0, (int)(delay - (int)elapsed));
-    }
-
-    // REDRAW READY: If a redraw is pending and NO frame callback is active,
-    // we should process it immediately (0 timeout).
-    if (app.redraw_pending && !app.frame_callback) {
-        timeout = 0;
-    }
-
-    // IF NEEDS HQ UPDATE: We need to ensure we wake up to draw the high quality frame
-    // This handles the transition from Fast -> Best filter
-    if (app.needs_hq_update && timeout == -1) {
-        bool conditions_active = (app.zooming_in || app.zooming_out || app.is_panning || app.is_animating);
-        
-        if (!conditions_active) {
-            auto now = std::chrono::steady_clock::now();
-            auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - app.last_interaction_time).count();
-            
-            if (elapsed_ms >= 100) {
-                 // Conditions met! Trigger redraw to apply High Quality
-                 app.redraw_pending = true;
-                 app.needs_hq_update = false;
-                 timeout = 0;
-            } else {
-                 // Need to wait for debounce
-                 timeout = 105 - (int)elapsed_ms; 
-            }
-        }
-    }
-    
-    if (poll(&pfd, 1, timeout) > 0) {
+    // 5. Sleep until the display, a worker or the next deadline wakes us.
+    // Work that could not be done above because every buffer is held waits
+    // for a wl_buffer.release on the display fd.
+    bool busy = (app.redraw_pending && !app.frame_callback && !app.pool.starved && app.configured) ||
+                (app.overlays_pending && app.configured && !app.info.pool.starved && !app.tray.pool.starved);
+    event_loop_arm(app.loop, std::min(gif_due, hq_due));
+    int fired = event_loop_wait(app.loop, display_fd, busy);
+    if (fired & LOOP_DISPLAY) {
       wl_display_read_events(app.display);
     } else {
       wl_display_cancel_read(app.display);
     }
     wl_display_dispatch_pending(app.display);
+
+    // Decode workers or the refiner finished something; new GIF frames are
+    // picked up by the tick above
+    if (fired & LOOP_WAKE) {
+      loader_collect(&app);
+      refine_collect(&app);
+    }
   }
 
+  if (app.player) gif_player_stop(app.player);
+  decoder_destroy(app.decoder);
+  refiner_destroy(app.refiner);
+  worker_pool_destroy(app.workers);
+  event_loop_destroy(app.loop);
   return 0;
 }
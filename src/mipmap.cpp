@@ -0,0 +1,103 @@
+#include "mipmap.h"
+#include "pixels.h"
+#include <cstring>
+
+static void halve_argb_row(const uint8_t *row0, const uint8_t *row1, uint8_t *dst, int width) {
+  const uint32_t *r0 = reinterpret_cast<const uint32_t*>(row0);
+  const uint32_t *r1 = reinterpret_cast<const uint32_t*>(row1);
+  uint32_t *out = reinterpret_cast<uint32_t*>(dst);
+  for (int x = 0; x < width; ++x) {
+    uint32_t a = r0[2 * x], b = r0[2 * x + 1], c = r1[2 * x], d = r1[2 * x + 1];
+    // Average each 8-bit channel; the low bits of each pair are summed
+    // separately so nothing carries into the neighboring channel
+    uint32_t hi = ((a >> 2) & 0x3F3F3F3F) + ((b >> 2) & 0x3F3F3F3F) +
+                  ((c >> 2) & 0x3F3F3F3F) + ((d >> 2) & 0x3F3F3F3F);
+    uint32_t lo = (a & 0x03030303) + (b & 0x03030303) + (c & 0x03030303) + (d & 0x03030303) + 0x02020202;
+    out[x] = hi + ((lo >> 2) & 0x03030303);
+  }
+}
+
+// Gray and packed RGB average byte by byte
+static void halve_bytes_row(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int width, int bpp) {
+  for (int x = 0; x < width; ++x, r0 += 2 * bpp, r1 += 2 * bpp, out += bpp) {
+    for (int k = 0; k < bpp; ++k) {
+      out[k] = (r0[k] + r0[k + bpp] + r1[k] + r1[k + bpp] + 2) >> 2;
+    }
+  }
+}
+
+// Copy row y of a tiled frame together
+static void gather_row(const PixelBuffer &src, int y, uint8_t *out) {
+  int bpp = bytes_per_pixel(src.format);
+  for (int x = 0, run; x < src.width; x += run) {
+    size_t off = pixel_offset(src, x, y, &run);
+    memcpy(out + (size_t)x * bpp, src.data.data() + off, (size_t)run * bpp);
+  }
+}
+
+static PixelBufferRef halve(const PixelBuffer &src) {
+  auto dst = std::make_shared<PixelBuffer>();
+  dst->width = src.width / 2;
+  dst->height = src.height / 2;
+  dst->format = src.format;
+  int bpp = bytes_per_pixel(src.format);
+  size_t src_stride = (size_t)src.width * bpp;
+  size_t dst_stride = (size_t)dst->width * bpp;
+  dst->data.resize(dst_stride * dst->height);
+
+  std::vector<uint8_t> rows(src.tile ? 2 * src_stride : 0);
+  for (int y = 0; y < dst->height; ++y) {
+    const uint8_t *r0, *r1;
+    if (src.tile) {
+      gather_row(src, 2 * y, rows.data());
+      gather_row(src, 2 * y + 1, rows.data() + src_stride);
+      r0 = rows.data();
+    } else {
+      r0 = src.data.data() + (size_t)(2 * y) * src_stride;
+    }
+    r1 = r0 + src_stride;
+    uint8_t *out = dst->data.data() + (size_t)y * dst_stride;
+    if (bpp == 4) halve_argb_row(r0, r1, out, dst->width);
+    else halve_bytes_row(r0, r1, out, dst->width, bpp);
+  }
+  tile_large_buffer(dst.get());
+  return dst;
+}
+
+// Averaged palette colors are not in the palette, so indexed images get
+// ARGB32 levels
+static PixelBufferRef expand_indexed(const PixelBuffer &src) {
+  auto argb = std::make_shared<PixelBuffer>();
+  argb->width = src.width;
+  argb->height = src.height;
+  argb->format = PIXEL_ARGB32;
+  argb->data.resize((size_t)src.width * src.height * 4);
+  expand_to_argb(src, 0, 0, src.width, src.height, reinterpret_cast<uint32_t*>(argb->data.data()), src.width);
+  tile_large_buffer(argb.get());
+  return argb;
+}
+
+std::vector<PixelBufferRef> build_mipmaps(const PixelBuffer &src, const std::atomic<bool> *cancelled) {
+  std::vector<PixelBufferRef> levels;
+  PixelBufferRef expanded;
+  const PixelBuffer *prev = &src;
+  if (src.format == PIXEL_INDEXED8) {
+    expanded = expand_indexed(src);
+    prev = expanded.get();
+  }
+  while (prev->width >= 128 && prev->height >= 128) {
+    if (cancelled && cancelled->load()) return {};
+    levels.push_back(halve(*prev));
+    prev = levels.back().get();
+  }
+  return levels;
+}
+
+const PixelBuffer *pick_mip_level(const CachedImage &img, double scale) {
+  const PixelBuffer *best = img.frames[0].get();
+  for (const PixelBufferRef &level : img.mips) {
+    if ((double)level->width / img.frame_width < scale) break;
+    best = level.get();
+  }
+  return best;
+}
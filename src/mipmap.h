@@ -0,0 +1,15 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include "app.h"
+#include <atomic>
+
+// Build successive 2x box-filtered reductions of `src`, down to about
+// 64 pixels on the short side. Returns an empty list if `cancelled` gets set.
+std::vector<PixelBufferRef> build_mipmaps(const PixelBuffer &src, const std::atomic<bool> *cancelled);
+
+// Smallest source for drawing `img` at `scale` times its frame size: a mip
+// level no smaller than the target, or the first frame itself
+const PixelBuffer *pick_mip_level(const CachedImage &img, double scale);
+
+#endif
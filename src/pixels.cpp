@@ -0,0 +1,250 @@
+#include "pixels.h"
+#include <algorithm>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+int bytes_per_pixel(pixel_format format) {
+  switch (format) {
+    case PIXEL_RGB24: return 3;
+    case PIXEL_GRAY8:
+    case PIXEL_INDEXED8: return 1;
+    default: return 4;
+  }
+}
+
+static bool is_gray(const uint32_t *argb, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t p = argb[i];
+    if (((p >> 16) & 0xFF) != (p & 0xFF) || ((p >> 8) & 0xFF) != (p & 0xFF)) return false;
+  }
+  return true;
+}
+
+// Collect up to 256 distinct colors; false as soon as there are more.
+// Photos bail out within the first few hundred pixels.
+static bool build_palette(const uint32_t *argb, size_t n, std::vector<uint32_t> *palette, std::vector<uint8_t> *indices) {
+  // Open-addressed table, 1024 slots so it stays sparse
+  uint32_t keys[1024];
+  int16_t slots[1024];
+  memset(slots, -1, sizeof(slots));
+
+  indices->resize(n);
+  uint32_t last = 0;
+  uint8_t last_index = 0;
+  bool have_last = false;
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t p = argb[i];
+    if (have_last && p == last) {
+      (*indices)[i] = last_index;
+      continue;
+    }
+
+    uint32_t h = (p * 2654435761u) >> 22;
+    while (slots[h] >= 0 && keys[h] != p) h = (h + 1) & 1023;
+    if (slots[h] < 0) {
+      if (palette->size() == 256) return false;
+      keys[h] = p;
+      slots[h] = (int16_t)palette->size();
+      palette->push_back(p);
+    }
+    last = p;
+    last_index = (uint8_t)slots[h];
+    have_last = true;
+    (*indices)[i] = last_index;
+  }
+  return true;
+}
+
+// Tiles are stored tile row by tile row, each tile with packed rows of its
+// own. The tiles on the right and bottom edges are cut to the frame, so
+// the tiled data is exactly as large as the plain one.
+size_t pixel_offset(const PixelBuffer &buf, int x, int y, int *run) {
+  int bpp = bytes_per_pixel(buf.format);
+  if (!buf.tile) {
+    *run = buf.width - x;
+    return ((size_t)y * buf.width + x) * bpp;
+  }
+  int tx = x - x % buf.tile, ty = y - y % buf.tile;
+  int tw = std::min(buf.tile, buf.width - tx);
+  int th = std::min(buf.tile, buf.height - ty);
+  *run = tx + tw - x;
+  return ((size_t)ty * buf.width + (size_t)tx * th + (size_t)(y - ty) * tw + (x - tx)) * bpp;
+}
+
+void tile_large_buffer(PixelBuffer *buf) {
+  if (buf->tile || (buf->width <= TILE_THRESHOLD && buf->height <= TILE_THRESHOLD)) return;
+  int bpp = bytes_per_pixel(buf->format);
+  size_t stride = (size_t)buf->width * bpp;
+  std::vector<uint8_t> tiled(buf->data.size());
+  buf->tile = TILE_SIZE;
+  for (int y = 0; y < buf->height; ++y) {
+    const uint8_t *row = buf->data.data() + (size_t)y * stride;
+    for (int x = 0, run; x < buf->width; x += run) {
+      size_t off = pixel_offset(*buf, x, y, &run);
+      memcpy(tiled.data() + off, row + (size_t)x * bpp, (size_t)run * bpp);
+    }
+  }
+  buf->data = std::move(tiled);
+}
+
+static std::shared_ptr<PixelBuffer> compact_buffer(int width, int height, const uint32_t *argb, bool has_alpha) {
+  auto buf = std::make_shared<PixelBuffer>();
+  buf->width = width;
+  buf->height = height;
+  size_t n = (size_t)width * height;
+
+  if (!has_alpha && is_gray(argb, n)) {
+    buf->format = PIXEL_GRAY8;
+    buf->data.resize(n);
+    for (size_t i = 0; i < n; ++i) buf->data[i] = argb[i] & 0xFF;
+    return buf;
+  }
+
+  auto palette = std::make_shared<std::vector<uint32_t>>();
+  if (build_palette(argb, n, palette.get(), &buf->data)) {
+    if (!has_alpha) {
+      for (uint32_t &c : *palette) c |= 0xFF000000u;
+    }
+    buf->format = PIXEL_INDEXED8;
+    buf->palette = palette;
+    return buf;
+  }
+
+  if (!has_alpha) {
+    buf->format = PIXEL_RGB24;
+    buf->data.resize(n * 3);
+    uint8_t *out = buf->data.data();
+    for (size_t i = 0; i < n; ++i, out += 3) {
+      out[0] = argb[i] & 0xFF;
+      out[1] = (argb[i] >> 8) & 0xFF;
+      out[2] = (argb[i] >> 16) & 0xFF;
+    }
+    return buf;
+  }
+
+  buf->format = PIXEL_ARGB32;
+  buf->data.resize(n * 4);
+  memcpy(buf->data.data(), argb, n * 4);
+  return buf;
+}
+
+PixelBufferRef make_compact_buffer(int width, int height, const uint32_t *argb, bool has_alpha) {
+  std::shared_ptr<PixelBuffer> buf = compact_buffer(width, height, argb, has_alpha);
+  tile_large_buffer(buf.get());
+  return buf;
+}
+
+static void expand_gray_row(const uint8_t *src, uint32_t *dst, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  // (g, g) and (g, 0xFF) byte pairs interleave into B, G, R, A = g, g, g, 0xFF
+  const __m128i ff = _mm_set1_epi8((char)0xFF);
+  for (; x + 16 <= n; x += 16) {
+    __m128i g = _mm_loadu_si128((const __m128i*)(src + x));
+    __m128i gg_lo = _mm_unpacklo_epi8(g, g), gg_hi = _mm_unpackhi_epi8(g, g);
+    __m128i ga_lo = _mm_unpacklo_epi8(g, ff), ga_hi = _mm_unpackhi_epi8(g, ff);
+    _mm_storeu_si128((__m128i*)(dst + x), _mm_unpacklo_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i*)(dst + x + 4), _mm_unpackhi_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i*)(dst + x + 8), _mm_unpacklo_epi16(gg_hi, ga_hi));
+    _mm_storeu_si128((__m128i*)(dst + x + 12), _mm_unpackhi_epi16(gg_hi, ga_hi));
+  }
+#endif
+  for (; x < n; ++x) dst[x] = 0xFF000000u | src[x] * 0x010101u;
+}
+
+static void expand_rgb_row_scalar(const uint8_t *src, uint32_t *dst, int from, int n) {
+  for (int x = from; x < n; ++x) {
+    const uint8_t *p = src + x * 3;
+    dst[x] = 0xFF000000u | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void expand_rgb_row_ssse3(const uint8_t *src, uint32_t *dst, int n) {
+  // Four packed pixels per shuffle; each 16-byte load reads 4 bytes past
+  // the 12 it uses, so stop while two pixels remain
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+  int x = 0;
+  for (; x + 6 <= n; x += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + x * 3));
+    _mm_storeu_si128((__m128i*)(dst + x), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+  }
+  expand_rgb_row_scalar(src, dst, x, n);
+}
+#endif
+
+static void expand_rgb_row(const uint8_t *src, uint32_t *dst, int n) {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  if (has_ssse3) {
+    expand_rgb_row_ssse3(src, dst, n);
+    return;
+  }
+#endif
+  expand_rgb_row_scalar(src, dst, 0, n);
+}
+
+// Expand n pixels that follow each other in memory
+static void expand_run(const PixelBuffer &src, const uint8_t *in, uint32_t *out, int n) {
+  switch (src.format) {
+    case PIXEL_GRAY8:
+      expand_gray_row(in, out, n);
+      break;
+    case PIXEL_RGB24:
+      expand_rgb_row(in, out, n);
+      break;
+    case PIXEL_INDEXED8: {
+      // A 1 KB palette stays in L1; a plain load beats a gather here
+      const uint32_t *pal = src.palette->data();
+      for (int i = 0; i < n; ++i) out[i] = pal[in[i]];
+      break;
+    }
+    default:
+      memcpy(out, in, (size_t)n * 4);
+      break;
+  }
+}
+
+void expand_to_argb(const PixelBuffer &src, int x, int y, int w, int h, uint32_t *dst, int dst_stride) {
+  for (int row = 0; row < h; ++row) {
+    uint32_t *out = dst + (size_t)row * dst_stride;
+    // One run per tile the row crosses, or the whole row
+    for (int i = 0, run; i < w; i += run) {
+      const uint8_t *in = src.data.data() + pixel_offset(src, x + i, y + row, &run);
+      run = std::min(run, w - i);
+      expand_run(src, in, out + i, run);
+    }
+  }
+}
+
+static uint32_t pixel_to_argb(const PixelBuffer &src, const uint8_t *p) {
+  switch (src.format) {
+    case PIXEL_GRAY8: return 0xFF000000u | p[0] * 0x010101u;
+    case PIXEL_RGB24: return 0xFF000000u | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+    case PIXEL_INDEXED8: return (*src.palette)[p[0]];
+    default: {
+      uint32_t v;
+      memcpy(&v, p, 4);
+      return v;
+    }
+  }
+}
+
+void sample_to_argb(const PixelBuffer &src, int x, int y, int w, int h, int step, uint32_t *dst, int dst_stride) {
+  int bpp = bytes_per_pixel(src.format);
+  for (int row = 0; row < h; ++row) {
+    uint32_t *out = dst + (size_t)row * dst_stride;
+    for (int i = 0; i < w;) {
+      int run;
+      const uint8_t *in = src.data.data() + pixel_offset(src, x + i * step, y + row * step, &run);
+      // Samples that land in this run
+      int n = std::min(w - i, (run + step - 1) / step);
+      for (int k = 0; k < n; ++k) out[i + k] = pixel_to_argb(src, in + (size_t)k * step * bpp);
+      i += n;
+    }
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef PIXELS_H
+#define PIXELS_H
+
+#include "app.h"
+
+// Frames with a side longer than TILE_THRESHOLD are stored in
+// TILE_SIZE x TILE_SIZE tiles, so drawing a small part of a panorama reads
+// a few compact blocks instead of thousands of long rows
+#define TILE_THRESHOLD 8192
+#define TILE_SIZE 256
+
+int bytes_per_pixel(pixel_format format);
+
+// Byte offset of pixel (x, y) in `buf.data`. *run gets the number of
+// pixels from it that follow in memory: the rest of its row, or of its
+// row within the tile.
+size_t pixel_offset(const PixelBuffer &buf, int x, int y, int *run);
+
+// Rearrange the pixels of a frame over TILE_THRESHOLD into tiles
+void tile_large_buffer(PixelBuffer *buf);
+
+// Store ARGB32 pixels in the most compact format that represents them
+// exactly: gray, indexed (256 colors or fewer), packed RGB if opaque,
+// or ARGB32 as a last resort.
+PixelBufferRef make_compact_buffer(int width, int height, const uint32_t *argb, bool has_alpha);
+
+// Expand a w x h block at (x, y) of any format to ARGB32, using SSE2/SSSE3
+// where the CPU has them. dst_stride is in pixels.
+void expand_to_argb(const PixelBuffer &src, int x, int y, int w, int h, uint32_t *dst, int dst_stride);
+
+// Like expand_to_argb(), but take every `step`-th pixel of every
+// `step`-th row: a w x h result from a (w * step) x (h * step) block
+void sample_to_argb(const PixelBuffer &src, int x, int y, int w, int h, int step, uint32_t *dst, int dst_stride);
+
+#endif
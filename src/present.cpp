@@ -0,0 +1,68 @@
+#include "present.h"
+#include <chrono>
+#include <time.h>
+
+// A commit waiting for its feedback
+struct present_request {
+  struct app_state *app;
+  int64_t committed; // CLOCK_MONOTONIC ns
+};
+
+static void presentation_clock_id(void *data, struct wp_presentation*, uint32_t clk_id) {
+  struct app_state *app = static_cast<struct app_state*>(data);
+  // steady_clock reads CLOCK_MONOTONIC, so only that clock can be compared with it
+  app->presentation_monotonic = clk_id == CLOCK_MONOTONIC;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+  .clock_id = presentation_clock_id,
+};
+
+static void feedback_sync_output(void*, struct wp_presentation_feedback*, struct wl_output*) {}
+
+static void feedback_presented(void *data, struct wp_presentation_feedback *feedback,
+                               uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+                               uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+  (void)seq_hi; (void)seq_lo;
+  struct present_request *req = static_cast<struct present_request*>(data);
+  present_timing *t = &req->app->timing;
+
+  int64_t shown = (int64_t)(((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000 + tv_nsec;
+  int64_t latency = shown - req->committed;
+  // Averaged, since where a commit falls between two vblanks varies
+  t->latency = t->valid ? (t->latency * 7 + latency) / 8 : latency;
+  t->vblank = shown;
+  // Without vsync, or on a variable refresh rate, there is no grid to aim at
+  t->refresh = (flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC) ? refresh : 0;
+  t->valid = true;
+
+  wp_presentation_feedback_destroy(feedback);
+  delete req;
+}
+
+static void feedback_discarded(void *data, struct wp_presentation_feedback *feedback) {
+  wp_presentation_feedback_destroy(feedback);
+  delete static_cast<struct present_request*>(data);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+  .sync_output = feedback_sync_output,
+  .presented = feedback_presented,
+  .discarded = feedback_discarded,
+};
+
+void present_init(struct app_state *app) {
+  wp_presentation_add_listener(app->presentation, &presentation_listener, app);
+}
+
+void present_feedback(struct app_state *app) {
+  // Only animation frames are paced by it
+  if (!app->presentation || !app->presentation_monotonic || !app->player) return;
+
+  struct present_request *req = new present_request();
+  req->app = app;
+  req->committed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  struct wp_presentation_feedback *feedback = wp_presentation_feedback(app->presentation, app->surface);
+  wp_presentation_feedback_add_listener(feedback, &feedback_listener, req);
+}
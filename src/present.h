@@ -0,0 +1,14 @@
+#ifndef PRESENT_H
+#define PRESENT_H
+
+#include "app.h"
+
+// Listen for the presentation clock, once wp_presentation is bound
+void present_init(struct app_state *app);
+
+// Ask when the next commit of the main surface reaches the screen, to
+// update app->timing. Call right before the commit; does nothing unless
+// an animation is playing.
+void present_feedback(struct app_state *app);
+
+#endif
@@ -0,0 +1,77 @@
+#include "refine.h"
+#include <unistd.h>
+
+static void refine_main(struct refiner *r) {
+  std::unique_lock<std::mutex> lock(r->mutex);
+  while (true) {
+    r->cv.wait(lock, [r] { return r->stopping || r->queued; });
+    if (r->stopping) return;
+
+    refine_job job = std::move(r->queued);
+    r->queued = nullptr;
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
+    r->cancelled = cancelled;
+    lock.unlock();
+
+    hq_cache result = {};
+    job(&result, cancelled.get());
+
+    lock.lock();
+    if (cancelled->load()) continue;
+    r->done = std::move(result);
+    r->has_done = true;
+
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) < 0) {
+      // Counter overflow is the only failure; the fd is already readable
+    }
+  }
+}
+
+struct refiner *refiner_create(int wake_fd) {
+  struct refiner *r = new refiner();
+  r->wake_fd = wake_fd;
+  r->has_done = false;
+  r->stopping = false;
+  r->thread = std::thread(refine_main, r);
+  return r;
+}
+
+void refiner_destroy(struct refiner *r) {
+  {
+    std::lock_guard<std::mutex> lock(r->mutex);
+    r->stopping = true;
+    if (r->cancelled) r->cancelled->store(true);
+  }
+  r->cv.notify_all();
+  r->thread.join();
+  delete r;
+}
+
+void refiner_start(struct refiner *r, refine_job job) {
+  {
+    std::lock_guard<std::mutex> lock(r->mutex);
+    if (r->cancelled) r->cancelled->store(true);
+    r->queued = std::move(job);
+    // A pass that finished but was not taken is as stale as the running one
+    r->done = hq_cache();
+    r->has_done = false;
+  }
+  r->cv.notify_all();
+}
+
+void refiner_cancel(struct refiner *r) {
+  std::lock_guard<std::mutex> lock(r->mutex);
+  if (r->cancelled) r->cancelled->store(true);
+  r->queued = nullptr;
+  r->done = hq_cache();
+  r->has_done = false;
+}
+
+bool refiner_take(struct refiner *r, hq_cache *out) {
+  std::lock_guard<std::mutex> lock(r->mutex);
+  if (!r->has_done) return false;
+  *out = std::move(r->done);
+  r->has_done = false;
+  return true;
+}
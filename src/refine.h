@@ -0,0 +1,42 @@
+#ifndef REFINE_H
+#define REFINE_H
+
+#include "app.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// A quality pass: fills `out` unless `cancelled` gets set first
+typedef std::function<void(hq_cache *out, const std::atomic<bool> *cancelled)> refine_job;
+
+// Runs quality passes on a thread of its own, one at a time, so the
+// Wayland thread only ever draws the fast path. Starting a pass cancels
+// the one before it.
+struct refiner {
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;  // Wakes the thread when a pass is queued
+  refine_job queued;           // Next pass, empty if none
+  std::shared_ptr<std::atomic<bool>> cancelled; // Set to drop the running pass
+  hq_cache done;               // Finished pass waiting for refiner_take()
+  bool has_done;
+  int wake_fd;                 // The event loop's eventfd, signalled when a pass finishes
+  bool stopping;
+};
+
+struct refiner *refiner_create(int wake_fd);
+void refiner_destroy(struct refiner *r);
+
+// Queue `job`, replacing a queued one, cancelling the one running and
+// dropping a finished one not taken yet
+void refiner_start(struct refiner *r, refine_job job);
+
+// Drop the queued, the running and the finished pass
+void refiner_cancel(struct refiner *r);
+
+// Take the finished pass, if there is one
+bool refiner_take(struct refiner *r, hq_cache *out);
+
+#endif
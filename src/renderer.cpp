@@ -2,14 +2,23 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <algorithm>
+#include <future>
 #include <cstring>
 #include <cstdio>
+#include <cmath>
 #include <vector>
 #include <string>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <cairo.h>
 #include "loader.h"
+#include "decoder.h"
+#include "mipmap.h"
+#include "gif.h"
+#include "pixels.h"
+#include "resample.h"
+#include "workers.h"
+#include "refine.h"
 
 static int create_shm_file(off_t size) {
   char name[] = "/wl_shm_XXXXXX";
@@ -54,205 +63,941 @@ void draw_icon(cairo_t *cr, double x, double y, int type) {
   cairo_restore(cr);
 }
 
-void create_buffer(struct app_state *app) {
-  int draw_width = app->width * app->buffer_scale;
-  int draw_height = app->height * app->buffer_scale;
-  int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, draw_width);
-  size_t size = (size_t)stride * draw_height;
+// Part of a source frame as ARGB32 pixels
+struct source_region {
+  const uint32_t *pixels;
+  int x, y;   // Within the frame
+  int w, h;   // Size in region pixels
+  int stride; // Pixels between rows
+  int step;   // Frame pixels per region pixel
+};
 
-  if (app->shm_fd == -1 || app->shm_size != size) {
-    if (app->shm_data) munmap(app->shm_data, app->shm_size);
-    if (app->shm_fd != -1) close(app->shm_fd);
+// Reused between frames so panning does not allocate; the refiner thread
+// has its own
+static thread_local std::vector<uint32_t> expand_scratch;
 
-    app->shm_fd = create_shm_file(size);
-    if (app->shm_fd == -1) die("create_shm_file failed");
-    app->shm_data = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, app->shm_fd, 0);
-    app->shm_size = size;
+// Only the part of the frame that lands in `view` (surface coordinates) is
+// read, plus a couple of pixels for the filter, so the work follows the
+// window size rather than the image size. Plain ARGB32 frames are drawn in
+// place; compact and tiled ones are expanded. With `sparse`, a frame shown
+// at under half its size (its mip levels not built yet) is point-sampled
+// down to about twice the view, which also keeps the region inside
+// Cairo's 32767 pixel limit.
+static source_region prepare_source(const PixelBuffer &src, double scale_x, double scale_y,
+                                    double offset_x, double offset_y, const cairo_rectangle_int_t &view,
+                                    bool sparse) {
+  int x0 = std::clamp((int)std::floor((view.x - offset_x) / scale_x) - 2, 0, src.width);
+  int y0 = std::clamp((int)std::floor((view.y - offset_y) / scale_y) - 2, 0, src.height);
+  int x1 = std::clamp((int)std::ceil((view.x + view.width - offset_x) / scale_x) + 2, 0, src.width);
+  int y1 = std::clamp((int)std::ceil((view.y + view.height - offset_y) / scale_y) + 2, 0, src.height);
+  int step = sparse ? std::max(1, (int)(0.5 / std::max(scale_x, scale_y))) : 1;
+  int w = (x1 - x0 + step - 1) / step, h = (y1 - y0 + step - 1) / step;
+  source_region region = {nullptr, x0, y0, w, h, w, step};
+  if (region.w <= 0 || region.h <= 0) return region;
 
-    if (app->buffer) wl_buffer_destroy(app->buffer);
-    struct wl_shm_pool *pool = wl_shm_create_pool(app->shm, app->shm_fd, size);
-    app->buffer = wl_shm_pool_create_buffer(pool, 0, draw_width, draw_height, stride, WL_SHM_FORMAT_ARGB8888);
-    wl_shm_pool_destroy(pool);
+  if (src.format == PIXEL_ARGB32 && !src.tile && step == 1) {
+    region.pixels = reinterpret_cast<const uint32_t*>(src.data.data()) + (size_t)y0 * src.width + x0;
+    region.stride = src.width;
+    return region;
   }
 
+  expand_scratch.resize((size_t)region.w * region.h);
+  if (step == 1) expand_to_argb(src, x0, y0, region.w, region.h, expand_scratch.data(), region.stride);
+  else sample_to_argb(src, x0, y0, region.w, region.h, step, expand_scratch.data(), region.stride);
+  region.pixels = expand_scratch.data();
+  return region;
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
+  struct buffer_pool *pool = static_cast<struct buffer_pool*>(data);
+  for (int i = 0; i < pool->count; ++i) {
+    if (pool->buffers[i].buffer == wl_buffer) pool->buffers[i].busy = false;
+  }
+  pool->starved = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+  .release = buffer_release
+};
+
+static void destroy_shm_buffer(struct shm_buffer *b) {
+  if (b->buffer) {
+    wl_buffer_destroy(b->buffer);
+    munmap(b->data, b->size);
+    close(b->fd);
+    cairo_region_destroy(b->damage);
+  }
+  *b = {};
+}
+
+static void init_shm_buffer(struct app_state *app, struct buffer_pool *pool, struct shm_buffer *b, int width, int height) {
+  b->width = width;
+  b->height = height;
+  b->stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+  b->size = (size_t)b->stride * height;
+  b->busy = false;
+
+  b->fd = create_shm_file(b->size);
+  if (b->fd == -1) die("create_shm_file failed");
+  b->data = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+  if (b->data == MAP_FAILED) die("mmap failed");
+
+  struct wl_shm_pool *shm_pool = wl_shm_create_pool(app->shm, b->fd, b->size);
+  b->buffer = wl_shm_pool_create_buffer(shm_pool, 0, width, height, b->stride, WL_SHM_FORMAT_ARGB8888);
+  wl_shm_pool_destroy(shm_pool);
+  wl_buffer_add_listener(b->buffer, &buffer_listener, pool);
+
+  // Nothing drawn in it yet
+  cairo_rectangle_int_t all = {0, 0, width, height};
+  b->damage = cairo_region_create_rectangle(&all);
+}
+
+// A buffer of `pool` the compositor is not reading, growing the pool up to
+// `limit` buffers. Returns nullptr, setting pool->starved, if all are held.
+static struct shm_buffer *acquire_buffer(struct app_state *app, struct buffer_pool *pool, int width, int height, int limit) {
+  struct shm_buffer *b = nullptr;
+  for (int i = 0; i < pool->count && !b; ++i) {
+    if (!pool->buffers[i].busy) b = &pool->buffers[i];
+  }
+  if (!b) {
+    if (pool->count >= limit) {
+      pool->starved = true;
+      return nullptr;
+    }
+    b = &pool->buffers[pool->count++];
+  }
+
+  // Buffers from before a resize are replaced as they come back
+  if (b->buffer && (b->width != width || b->height != height)) destroy_shm_buffer(b);
+  if (!b->buffer) init_shm_buffer(app, pool, b, width, height);
+  return b;
+}
+
+static cairo_rectangle_int_t enclosing_rect(double x, double y, double w, double h) {
+  int x0 = (int)std::floor(x), y0 = (int)std::floor(y);
+  return {x0, y0, (int)std::ceil(x + w) - x0, (int)std::ceil(y + h) - y0};
+}
+
+// Buffer pixels for `size` surface pixels; rounded like the compositor
+// rounds a fractionally scaled window
+static int buffer_size(struct app_state *app, int size) {
+  return (int)std::lround(size * app->buffer_scale);
+}
+
+void damage_rect(struct app_state *app, int x, int y, int w, int h) {
+  double scale = app->buffer_scale;
+  cairo_rectangle_int_t r = enclosing_rect(x * scale, y * scale, w * scale, h * scale);
+  cairo_region_union_rectangle(app->damage, &r);
+  // Every buffer in the pool misses this change until it is next drawn
+  for (int i = 0; i < app->pool.count; ++i) {
+    cairo_region_union_rectangle(app->pool.buffers[i].damage, &r);
+  }
+}
+
+void damage_all(struct app_state *app) {
+  damage_rect(app, 0, 0, app->width, app->height);
+}
+
+void update_buffer_scale(struct app_state *app) {
+  double scale = app->preferred_scale ? app->preferred_scale / 120.0 : std::max(app->output_scale, 1);
+  if (scale == app->buffer_scale) return;
+  app->buffer_scale = scale;
+  damage_all(app);
+  app->redraw_pending = true;
+}
+
+// Map the next buffer of `surface` onto `width` x `height` surface pixels:
+// through its viewport when there is one, else by the integer scale
+static void set_surface_scale(struct app_state *app, struct wl_surface *surface, struct wp_viewport *viewport,
+                              int width, int height) {
+  if (viewport) {
+    wp_viewport_set_destination(viewport, width, height);
+  } else {
+    wl_surface_set_buffer_scale(surface, (int)app->buffer_scale);
+  }
+}
+
+// Resolving "Sans" the first time makes fontconfig read its configuration
+// and scan the font directories, which can take hundreds of milliseconds
+static cairo_scaled_font_t *load_overlay_font() {
+  cairo_font_face_t *face = cairo_toy_font_face_create("Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+  cairo_matrix_t size, identity;
+  cairo_matrix_init_scale(&size, 18.0, 18.0);
+  cairo_matrix_init_identity(&identity);
+  cairo_font_options_t *options = cairo_font_options_create();
+  cairo_scaled_font_t *font = cairo_scaled_font_create(face, &size, &identity, options);
+  cairo_font_options_destroy(options);
+  cairo_font_face_destroy(face);
+
+  // Loads the font file and the glyphs the overlay always shows
+  cairo_text_extents_t extents;
+  cairo_scaled_font_text_extents(font, "Res: Zoom: Index: Cache: images, MB (peak) | Hits: 0123456789x/.", &extents);
+  return font;
+}
+
+void overlay_font_load(struct app_state *app) {
+  app->font_loading = std::async(std::launch::async, load_overlay_font);
+}
+
+// Waits only if the info overlay opens before the font finished loading
+static cairo_scaled_font_t *overlay_font(struct app_state *app) {
+  if (!app->font) app->font = app->font_loading.valid() ? app->font_loading.get() : load_overlay_font();
+  return app->font;
+}
+
+static info_source current_info_source(struct app_state *app) {
+  info_source key = {};
+  key.index = app->current_index;
+  key.count = app->images.size();
+  auto it = app->cache.find(app->current_index);
+  if (it != app->cache.end()) {
+    key.width = it->second.width;
+    key.height = it->second.height;
+    key.exif_loaded = it->second.exif_loaded;
+    key.exif_lines = it->second.exif_data.size();
+  }
+  key.zoom = app->zoom;
+  key.cached = app->cache.size();
+  key.cache_bytes = app->cache_bytes;
+  key.cache_peak_bytes = app->cache_peak_bytes;
+  key.cache_budget = app->cache_budget;
+  key.cache_hits = app->cache_hits;
+  key.cache_misses = app->cache_misses;
+  return key;
+}
+
+static bool same_info_source(const info_source &a, const info_source &b) {
+  return a.index == b.index && a.count == b.count && a.width == b.width && a.height == b.height &&
+         a.zoom == b.zoom && a.cached == b.cached && a.cache_bytes == b.cache_bytes &&
+         a.cache_peak_bytes == b.cache_peak_bytes && a.cache_budget == b.cache_budget &&
+         a.cache_hits == b.cache_hits && a.cache_misses == b.cache_misses &&
+         a.exif_loaded == b.exif_loaded && a.exif_lines == b.exif_lines;
+}
+
+// What the info overlay says and where it goes
+static void layout_info(struct app_state *app, overlay_layout *layout) {
+  auto it = app->cache.find(app->current_index);
+  std::vector<std::string> &lines = layout->info_lines;
+  int w = 0, h = 0;
+  if (it != app->cache.end()) { w = it->second.width; h = it->second.height; }
+  lines.push_back(app->images[app->current_index]);
+  lines.push_back("Res: " + std::to_string(w) + "x" + std::to_string(h));
+  lines.push_back("Zoom: " + std::to_string(app->zoom).substr(0,4) + "x | Index: " + std::to_string(app->current_index + 1) + "/" + std::to_string(app->images.size()));
+  lines.push_back("Cache: " + std::to_string(app->cache.size()) + " images, " +
+                  std::to_string(app->cache_bytes >> 20) + "/" + std::to_string(app->cache_budget >> 20) + " MB (peak " +
+                  std::to_string(app->cache_peak_bytes >> 20) + ") | Hits: " + std::to_string(app->cache_hits) + "/" +
+                  std::to_string(app->cache_hits + app->cache_misses));
+
+  // Use cached metadata
+  if (it != app->cache.end()) {
+      if (!it->second.exif_loaded) lines.push_back("Reading metadata...");
+      for (const auto& line : it->second.exif_data) {
+          lines.push_back(line);
+      }
+  }
+
+  // Calculate max width for dynamic background
+  cairo_scaled_font_t *font = overlay_font(app);
+  double max_w = 200;
+  for (const auto& line : lines) {
+    cairo_text_extents_t extents;
+    cairo_scaled_font_text_extents(font, line.c_str(), &extents);
+    if (extents.width > max_w) max_w = extents.width;
+  }
+  layout->info_rect = enclosing_rect(20, 20, max_w + 40, lines.size() * 25 + 30);
+}
+
+// Where the tray goes and whether it shows
+static void layout_tray(struct app_state *app, overlay_layout *layout) {
+  int btn_w = 40, spacing = 20;
+  int tray_w = 3 * btn_w + 4 * spacing;
+  int tray_h = btn_w + 20;
+  layout->tray_rect = enclosing_rect((app->width - tray_w) / 2.0, app->height - tray_h - 20, tray_w, tray_h);
+  // Only show tray if mouse is near bottom (75%) and app is not zooming or panning
+  layout->tray_visible = app->mouse_y > app->height * 0.75 && !(app->zooming_in || app->zooming_out || app->is_panning);
+}
+
+static void clear_region(cairo_region_t *region) {
+  cairo_rectangle_int_t none = {0, 0, 0, 0};
+  cairo_region_intersect_rectangle(region, &none);
+}
+
+// Tell the compositor what changed since the last commit, then start over
+static void submit_damage(struct app_state *app) {
+  int n = cairo_region_num_rectangles(app->damage);
+  for (int i = 0; i < n; ++i) {
+    cairo_rectangle_int_t r;
+    cairo_region_get_rectangle(app->damage, i, &r);
+    wl_surface_damage_buffer(app->surface, r.x, r.y, r.width, r.height);
+  }
+  clear_region(app->damage);
+}
+
+// Size of `img` on screen at the current zoom, in surface coordinates
+static void fit_image(struct app_state *app, const CachedImage &img, double *draw_w, double *draw_h) {
+  double window_aspect = (double)app->width / app->height;
+  double image_aspect = (double)img.width / img.height;
+  if (window_aspect > image_aspect) {
+    *draw_h = app->height * app->zoom;
+    *draw_w = *draw_h * image_aspect;
+  } else {
+    *draw_w = app->width * app->zoom;
+    *draw_h = *draw_w / image_aspect;
+  }
+}
+
+// "Active" mode (performance critical) rather than "Idle" mode (quality critical)
+static bool in_fast_mode(struct app_state *app) {
+  if (app->zooming_in || app->zooming_out || app->is_panning || app->is_animating) return true;
+
+  // Also include the 100ms debounce
+  auto now = std::chrono::steady_clock::now();
+  auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - app->last_interaction_time).count();
+  return elapsed_ms < 100;
+}
+
+void scaled_view_init(struct app_state *app) {
+  struct scaled_view *v = &app->view;
+  v->surface = wl_compositor_create_surface(app->compositor);
+  v->subsurface = wl_subcompositor_get_subsurface(app->subcompositor, v->surface, app->surface);
+  v->viewport = wp_viewporter_get_viewport(app->viewporter, v->surface);
+  // Synchronized: a new crop lands in the same frame as the blank image surface
+
+  struct wl_region *no_input = wl_compositor_create_region(app->compositor);
+  wl_surface_set_input_region(v->surface, no_input);
+  wl_region_destroy(no_input);
+}
+
+// Scale the whole image into a fresh buffer of the view and attach it.
+// False if both buffers are still held.
+static bool scale_into_view(struct app_state *app, const CachedImage &img, int width, int height) {
+  struct scaled_view *v = &app->view;
+  struct shm_buffer *b = acquire_buffer(app, &v->pool, width, height, 2);
+  if (!b) return false;
+
+  const PixelBuffer *src = pick_mip_level(img, (double)width / img.frame_width);
+  double scale_x = (double)width / src->width;
+  double scale_y = (double)height / src->height;
+  cairo_rectangle_int_t all = {0, 0, width, height};
+  source_region region = prepare_source(*src, scale_x, scale_y, 0, 0, all, true);
+
+  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char*)b->data, CAIRO_FORMAT_ARGB32, width, height, b->stride);
+  cairo_t *cr = cairo_create(surface);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  if (region.w > 0 && region.h > 0) {
+    bool opaque = src->format != PIXEL_ARGB32 && src->format != PIXEL_INDEXED8;
+    cairo_surface_t *img_surface = cairo_image_surface_create_for_data(
+        (unsigned char*)region.pixels, opaque ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
+        region.w, region.h, region.stride * 4);
+    cairo_scale(cr, scale_x * region.step, scale_y * region.step);
+    cairo_set_source_surface(cr, img_surface, (double)region.x / region.step, (double)region.y / region.step);
+    // Done once per gesture or so, so it can afford the better filter
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    // Edge pixels stay opaque instead of fading into the border
+    cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+    cairo_paint(cr);
+    cairo_surface_destroy(img_surface);
+  }
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+  clear_region(b->damage);
+  b->busy = true;
+
+  wl_surface_attach(v->surface, b->buffer, 0, 0);
+  wl_surface_damage_buffer(v->surface, 0, 0, width, height);
+  v->shown = true;
+  v->index = app->current_index;
+  v->frame = img.frames[0];
+  v->width = width;
+  v->height = height;
+  return true;
+}
+
+// Show the current image on the view, cropped and stretched by the
+// compositor to the current zoom and pan. The buffer is rescaled only for
+// another image or frame, or once the zoom drifts too far from its
+// resolution. False if the image has to be drawn on the CPU instead.
+static bool present_scaled_view(struct app_state *app) {
+  if (!app->viewporter || !in_fast_mode(app)) return false;
+  // An animation changes frames under it
+  if (app->player && app->player->index == app->current_index) return false;
+  auto it = app->cache.find(app->current_index);
+  if (it == app->cache.end() || it->second.frames.empty()) return false;
+  const CachedImage &img = it->second;
+  struct scaled_view *v = &app->view;
+
+  double draw_w, draw_h;
+  fit_image(app, img, &draw_w, &draw_h);
+  double offset_x = (app->width - draw_w) / 2.0 + app->pan_x;
+  double offset_y = (app->height - draw_h) / 2.0 + app->pan_y;
+
+  // Subsurfaces are not clipped to the window, so only the visible part is shown
+  int x0 = std::max(0, (int)std::lround(offset_x));
+  int y0 = std::max(0, (int)std::lround(offset_y));
+  int x1 = std::min(app->width, (int)std::lround(offset_x + draw_w));
+  int y1 = std::min(app->height, (int)std::lround(offset_y + draw_h));
+  if (x1 <= x0 || y1 <= y0) return false;
+
+  // The image at output resolution, but no sharper than the frame, no wider
+  // than compositors take, and within a few windows' worth of pixels
+  double window_px = (double)app->width * app->height * app->buffer_scale * app->buffer_scale;
+  double frame_px = (double)img.frame_width * img.frame_height;
+  double scale = std::min({draw_w * app->buffer_scale / img.frame_width, 1.0,
+                           8192.0 / img.frame_width, 8192.0 / img.frame_height,
+                           std::sqrt(4 * window_px / frame_px)});
+  int want_w = std::max(1, (int)std::lround(img.frame_width * scale));
+  int want_h = std::max(1, (int)std::lround(img.frame_height * scale));
+
+  bool stale = !v->shown || v->index != app->current_index || v->frame != img.frames[0];
+  double drift = v->shown ? (double)want_w / v->width : 0;
+  if (stale || drift < 0.5 || drift > 1.5) {
+    // With both buffers held, a drifted one is stretched a little longer
+    if (!scale_into_view(app, img, want_w, want_h) && stale) return false;
+  }
+
+  // Source in 1/256 buffer pixels, kept inside the buffer since anything
+  // outside is a protocol error
+  double kx = v->width / draw_w, ky = v->height / draw_h;
+  int src_x = std::clamp((int)((x0 - offset_x) * kx * 256), 0, v->width * 256 - 1);
+  int src_y = std::clamp((int)((y0 - offset_y) * ky * 256), 0, v->height * 256 - 1);
+  int src_w = std::clamp((int)((x1 - x0) * kx * 256), 1, v->width * 256 - src_x);
+  int src_h = std::clamp((int)((y1 - y0) * ky * 256), 1, v->height * 256 - src_y);
+
+  wl_subsurface_set_position(v->subsurface, x0, y0);
+  wp_viewport_set_source(v->viewport, src_x, src_y, src_w, src_h);
+  wp_viewport_set_destination(v->viewport, x1 - x0, y1 - y0);
+  wl_surface_commit(v->surface);
+  return true;
+}
+
+static void hide_scaled_view(struct app_state *app) {
+  struct scaled_view *v = &app->view;
+  wl_surface_attach(v->surface, NULL, 0, 0);
+  wl_surface_commit(v->surface);
+  v->shown = false;
+  v->frame = nullptr;
+}
+
+// The view's buffers are large; free them once the compositor lets go
+static void trim_scaled_view(struct app_state *app) {
+  struct buffer_pool *pool = &app->view.pool;
+  for (int i = 0; i < pool->count; ++i) {
+    if (pool->buffers[i].busy) return;
+  }
+  for (int i = 0; i < pool->count; ++i) destroy_shm_buffer(&pool->buffers[i]);
+  pool->count = 0;
+}
+
+// Where the current image goes on screen and what it is sampled from
+struct image_layout {
+  const CachedImage *img;
+  PixelBufferRef src;         // Animation frame, mip level or first frame
+  double draw_w, draw_h;      // Size on screen, surface coordinates
+  double offset_x, offset_y;  // Top-left on screen
+};
+
+// False while the current image has nothing decoded
+static bool layout_image(struct app_state *app, image_layout *l) {
+  auto it = app->cache.find(app->current_index);
+  if (it == app->cache.end() || it->second.frames.empty()) return false;
+  l->img = &it->second;
+  fit_image(app, it->second, &l->draw_w, &l->draw_h);
+  l->offset_x = (app->width - l->draw_w) / 2.0 + app->pan_x;
+  l->offset_y = (app->height - l->draw_h) / 2.0 + app->pan_y;
+
+  // Sample the animation's current frame, or else the smallest mip level
+  // that still covers the output pixels
+  if (app->player && app->player->index == app->current_index && app->player->shown) {
+    l->src = app->player->shown;
+  } else {
+    double screen_scale = l->draw_w * app->buffer_scale / it->second.frame_width;
+    const PixelBuffer *level = pick_mip_level(it->second, screen_scale);
+    l->src = it->second.frames[0];
+    for (const PixelBufferRef &mip : it->second.mips) {
+      if (mip.get() == level) l->src = mip;
+    }
+  }
+  return true;
+}
+
+// Bands of rows of `rects`, enough to keep `bands` workers busy
+static std::vector<cairo_rectangle_int_t> row_strips(int bands, const cairo_rectangle_int_t *rects, int count) {
+  std::vector<cairo_rectangle_int_t> strips;
+  for (int i = 0; i < count; ++i) {
+    const cairo_rectangle_int_t &r = rects[i];
+    int rows = std::max((r.height + bands - 1) / bands, 32);
+    for (int y = r.y; y < r.y + r.height; y += rows) {
+      strips.push_back({r.x, y, r.width, std::min(rows, r.y + r.height - y)});
+    }
+  }
+  return strips;
+}
+
+static cairo_rectangle_int_t intersect_rect(const cairo_rectangle_int_t &a, const cairo_rectangle_int_t &b) {
+  int x0 = std::max(a.x, b.x), y0 = std::max(a.y, b.y);
+  int x1 = std::min(a.x + a.width, b.x + b.width), y1 = std::min(a.y + a.height, b.y + b.height);
+  if (x1 <= x0 || y1 <= y0) return {0, 0, 0, 0};
+  return {x0, y0, x1 - x0, y1 - y0};
+}
+
+// The cached pixels, moved along with the pan since they were rendered
+static cairo_rectangle_int_t hq_cache_rect(struct app_state *app, const image_layout &l) {
+  const hq_cache &c = app->hq;
+  cairo_rectangle_int_t r = c.rect;
+  r.x += (int)std::lround(l.offset_x * app->buffer_scale) - c.origin_x;
+  r.y += (int)std::lround(l.offset_y * app->buffer_scale) - c.origin_y;
+  return r;
+}
+
+// Whether the last quality pass scaled the same source to the same size
+// and still covers every visible pixel of the image
+static bool hq_cache_hit(struct app_state *app, const image_layout &l) {
+  const hq_cache &c = app->hq;
+  double scale = app->buffer_scale;
+  if (c.pixels.empty()) return false;
+  if (c.index != app->current_index || c.frame != l.img->frames[0] || c.source != l.src ||
+      c.zoom != app->zoom || c.scale != scale ||
+      c.draw_width != (int)std::lround(l.draw_w * scale) || c.draw_height != (int)std::lround(l.draw_h * scale)) {
+    return false;
+  }
+
+  cairo_rectangle_int_t window = {0, 0, buffer_size(app, app->width), buffer_size(app, app->height)};
+  cairo_rectangle_int_t image = enclosing_rect(l.offset_x * scale, l.offset_y * scale, l.draw_w * scale, l.draw_h * scale);
+  cairo_rectangle_int_t visible = intersect_rect(window, image);
+  cairo_rectangle_int_t cached = hq_cache_rect(app, l);
+  return visible.width == 0 ||
+         (cached.x <= visible.x && cached.y <= visible.y &&
+          cached.x + cached.width >= visible.x + visible.width &&
+          cached.y + cached.height >= visible.y + visible.height);
+}
+
+// Everything a quality pass reads, copied so the view can move on while
+// it runs
+static hq_request make_hq_request(struct app_state *app, const image_layout &l) {
+  hq_request req;
+  req.index = app->current_index;
+  req.frame = l.img->frames[0];
+  req.source = l.src;
+  req.has_alpha = l.img->has_alpha;
+  req.playing = app->player && app->player->index == app->current_index;
+  req.zoom = app->zoom;
+  req.scale = app->buffer_scale;
+  req.width = app->width;
+  req.height = app->height;
+  req.draw_w = l.draw_w;
+  req.draw_h = l.draw_h;
+  req.offset_x = l.offset_x;
+  req.offset_y = l.offset_y;
+  return req;
+}
+
+// The same source scaled the same way; the views differ at most by a pan
+static bool same_scaling(const hq_request &a, const hq_request &b) {
+  return a.index == b.index && a.frame == b.frame && a.source == b.source && a.zoom == b.zoom &&
+         a.scale == b.scale && a.width == b.width && a.height == b.height &&
+         a.draw_w == b.draw_w && a.draw_h == b.draw_h;
+}
+
+// Resample the image around the requested view, a quarter window beyond
+// it on each side, into `c`. Runs on the refiner thread.
+static void hq_render(const hq_request &req, struct worker_pool *workers, hq_cache *c,
+                      const std::atomic<bool> *cancelled) {
+  double scale = req.scale;
+  int window_w = (int)std::lround(req.width * scale), window_h = (int)std::lround(req.height * scale);
+
+  // An animation replaces its frame too often for the margin to pay off
+  int margin_x = req.playing ? 0 : window_w / 4;
+  int margin_y = req.playing ? 0 : window_h / 4;
+  cairo_rectangle_int_t around = {-margin_x, -margin_y, window_w + 2 * margin_x, window_h + 2 * margin_y};
+  cairo_rectangle_int_t image = enclosing_rect(req.offset_x * scale, req.offset_y * scale, req.draw_w * scale, req.draw_h * scale);
+  cairo_rectangle_int_t rect = intersect_rect(around, image);
+
+  const PixelBuffer &src = *req.source;
+  double scale_x = req.draw_w / src.width;
+  double scale_y = req.draw_h / src.height;
+  cairo_rectangle_int_t view = enclosing_rect((double)rect.x / scale, (double)rect.y / scale,
+                                              (double)rect.width / scale, (double)rect.height / scale);
+  source_region region = prepare_source(src, scale_x, scale_y, req.offset_x, req.offset_y, view, false);
+
+  if (rect.width > 0 && region.w > 0 && region.h > 0) {
+    // Opaque black, like the background: pixels the image does not reach
+    // must not let the desktop show through
+    c->pixels.assign((size_t)rect.width * rect.height, 0xFF000000u);
+    // Rounded from the same origin as origin_x and origin_y, so a pan
+    // past the left or top edge does not shift the copy by a pixel
+    cairo_rectangle_int_t placed = {
+        (int)std::lround(req.offset_x * scale) + (int)std::lround(region.x * scale_x * scale) - rect.x,
+        (int)std::lround(req.offset_y * scale) + (int)std::lround(region.y * scale_y * scale) - rect.y,
+        (int)std::lround(region.w * scale_x * scale),
+        (int)std::lround(region.h * scale_y * scale)};
+    cairo_rectangle_int_t all = {0, 0, rect.width, rect.height};
+    std::vector<cairo_rectangle_int_t> strips = row_strips(worker_pool_size(workers), &all, 1);
+    worker_pool_run(workers, (int)strips.size(), [&](int i) {
+      if (cancelled->load()) return;
+      resample(region.pixels, region.w, region.h, region.stride,
+               c->pixels.data(), rect.width, placed, strips[i], req.has_alpha);
+    });
+  }
+
+  c->rect = rect;
+  c->origin_x = (int)std::lround(req.offset_x * scale);
+  c->origin_y = (int)std::lround(req.offset_y * scale);
+  c->index = req.index;
+  c->frame = req.frame;
+  c->source = req.source;
+  c->zoom = req.zoom;
+  c->scale = scale;
+  c->draw_width = (int)std::lround(req.draw_w * scale);
+  c->draw_height = (int)std::lround(req.draw_h * scale);
+}
+
+// Queue a quality pass for the current view, unless that exact one is
+// already on its way
+static void request_refinement(struct app_state *app, const image_layout &l) {
+  hq_request req = make_hq_request(app, l);
+  // A tiled frame shown under half size waits for its mip levels, which
+  // land with a redraw, instead of expanding most of itself for the pass
+  if (l.src->tile && req.draw_w * req.scale < l.src->width * 0.5) return;
+  const hq_request &was = app->refine_request;
+  if (app->refining && same_scaling(req, was) && req.offset_x == was.offset_x && req.offset_y == was.offset_y) return;
+
+  app->refine_request = req;
+  app->refining = true;
+  struct worker_pool *workers = app->workers;
+  refiner_start(app->refiner, [req, workers](hq_cache *out, const std::atomic<bool> *cancelled) {
+    hq_render(req, workers, out, cancelled);
+  });
+}
+
+// Drop a pass the view has moved away from. A pan keeps it: the margin
+// may still cover where the view ends up.
+static void cancel_stale_refinement(struct app_state *app, const image_layout *l) {
+  if (!app->refining) return;
+  if (l && same_scaling(make_hq_request(app, *l), app->refine_request)) return;
+  refiner_cancel(app->refiner);
+  app->refining = false;
+}
+
+void refine_collect(struct app_state *app) {
+  if (!refiner_take(app->refiner, &app->hq)) return;
+  app->refining = false;
+
+  image_layout l;
+  if (layout_image(app, &l) && hq_cache_hit(app, l)) {
+    damage_all(app);
+    app->redraw_pending = true;
+  } else {
+    // The view moved on; a fresh pass starts once it settles
+    app->needs_hq_update = true;
+  }
+}
+
+// Copy what the cache has of the damaged part of `target`
+static void hq_cache_blit(struct app_state *app, const image_layout &l, struct shm_buffer *target) {
+  const hq_cache &c = app->hq;
+  cairo_rectangle_int_t cached = hq_cache_rect(app, l);
+  uint8_t *dst = static_cast<uint8_t*>(target->data);
+  int count = cairo_region_num_rectangles(target->damage);
+  for (int i = 0; i < count; ++i) {
+    cairo_rectangle_int_t r;
+    cairo_region_get_rectangle(target->damage, i, &r);
+    r = intersect_rect(r, cached);
+    for (int y = r.y; y < r.y + r.height; ++y) {
+      const uint32_t *from = &c.pixels[(size_t)(y - cached.y) * c.rect.width + (r.x - cached.x)];
+      memcpy(dst + (size_t)y * target->stride + (size_t)r.x * 4, from, (size_t)r.width * 4);
+    }
+  }
+}
+
+bool create_buffer(struct app_state *app) {
+  int draw_width = buffer_size(app, app->width);
+  int draw_height = buffer_size(app, app->height);
+
+  // While the view stands in for the image, the image surface only needs
+  // to be blank behind it
+  struct scaled_view *v = &app->view;
+  image_layout layout;
+  bool have_image = layout_image(app, &layout);
+  // A pan at the zoom of the last quality pass is copied from it, at full
+  // quality, rather than handed to the compositor
+  bool cached = have_image && hq_cache_hit(app, layout);
+  bool fast_mode = in_fast_mode(app);
+  if (fast_mode) cancel_stale_refinement(app, have_image ? &layout : nullptr);
+  bool backdrop = !cached && present_scaled_view(app);
+  if (backdrop) {
+    if (v->backdrop_width == draw_width && v->backdrop_height == draw_height) return true;
+    damage_all(app);
+  } else {
+    if (v->shown) {
+      // The CPU drawn image replaces the view in the same commit
+      hide_scaled_view(app);
+      damage_all(app);
+    }
+    trim_scaled_view(app);
+  }
+
+  // Two buffers are enough while idle. A third is added only when both are
+  // still held in the middle of an animation, and dropped once things settle.
+  bool animating = app->is_animating || app->zooming_in || app->zooming_out || app->is_panning || app->player;
+  if (!animating && app->pool.count == 3 && !app->pool.buffers[2].busy) {
+    destroy_shm_buffer(&app->pool.buffers[2]);
+    app->pool.count = 2;
+  }
+
+  // Never draw into a buffer the compositor may still be reading
+  struct shm_buffer *target = acquire_buffer(app, &app->pool, draw_width, draw_height, animating ? 3 : 2);
+  if (!target) return false;
+  int stride = target->stride;
+
   // Draw directly to SHM
-  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char*)app->shm_data, CAIRO_FORMAT_ARGB32, draw_width, draw_height, stride);
+  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char*)target->data, CAIRO_FORMAT_ARGB32, draw_width, draw_height, stride);
   cairo_t *cr = cairo_create(surface);
   
   // Scale for HiDPI
   cairo_scale(cr, app->buffer_scale, app->buffer_scale);
 
+  // Repaint only what this buffer has missed since it was last drawn
+  cairo_rectangle_int_t bounds = {0, 0, draw_width, draw_height};
+  cairo_region_intersect_rectangle(target->damage, &bounds);
+  cairo_region_intersect_rectangle(app->damage, &bounds);
+  int clip_count = cairo_region_num_rectangles(target->damage);
+  cairo_identity_matrix(cr);
+  for (int i = 0; i < clip_count; ++i) {
+    cairo_rectangle_int_t r;
+    cairo_region_get_rectangle(target->damage, i, &r);
+    cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+  }
+  cairo_clip(cr);
+  cairo_scale(cr, app->buffer_scale, app->buffer_scale);
+
+  // The clip in surface coordinates, to limit how much of the source is expanded
+  cairo_rectangle_int_t clip;
+  cairo_region_get_extents(target->damage, &clip);
+  double scale = app->buffer_scale;
+  clip = enclosing_rect((double)clip.x / scale, (double)clip.y / scale, (double)clip.width / scale, (double)clip.height / scale);
+
   // Background
   cairo_set_source_rgb(cr, 0, 0, 0);
   cairo_paint(cr);
 
   // Render Image
-  auto it = app->cache.find(app->current_index);
-  if (it != app->cache.end() && !it->second.frames.empty()) {
-    Imlib_Image src_img = it->second.frames[app->current_frame_index % it->second.frames.size()];
-    
-    // Check if we are in "Active" mode (Performance critical) or "Idle" mode (Quality critical)
-    bool fast_mode = (app->zooming_in || app->zooming_out || app->is_panning || app->is_animating);
-    
-    // Also include the 100ms debounce
-    if (!fast_mode) {
-        auto now = std::chrono::steady_clock::now();
-        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - app->last_interaction_time).count();
-        if (elapsed_ms < 100) fast_mode = true;
-    }
+  if (backdrop) {
+    // Drawn by the compositor from the view
+  } else if (cached) {
+    // --- QUALITY PATH (copied from the refined cache) ---
+    cairo_surface_flush(surface);
+    hq_cache_blit(app, layout, target);
+    cairo_surface_mark_dirty(surface);
+  } else if (have_image) {
+    // The quality pass runs in the background and lands with its own
+    // redraw, so input never waits for it
+    if (!fast_mode) request_refinement(app, layout);
 
-    if (fast_mode) {
+    const PixelBuffer *src = layout.src.get();
+    double scale_x = layout.draw_w / src->width;
+    double scale_y = layout.draw_h / src->height;
+    source_region region = prepare_source(*src, scale_x, scale_y, layout.offset_x, layout.offset_y, clip, true);
+
+    if (region.w > 0 && region.h > 0) {
         // --- FAST PATH (Cairo) ---
-        // Imlib2 images are ARGB32, compatible with Cairo
-        imlib_context_set_image(src_img);
-        int w = imlib_image_get_width();
-        int h = imlib_image_get_height();
-        uint32_t *data = imlib_image_get_data_for_reading_only();
-        
+        // Opaque formats skip Cairo's alpha blending
+        bool opaque = src->format != PIXEL_ARGB32 && src->format != PIXEL_INDEXED8;
         cairo_surface_t *img_surface = cairo_image_surface_create_for_data(
-            (unsigned char*)data, CAIRO_FORMAT_ARGB32, w, h, w * 4);
-        
-        double window_aspect = (double)app->width / app->height;
-        double image_aspect = (double)w / h;
-
-        double draw_w, draw_h;
-        if (window_aspect > image_aspect) {
-          draw_h = app->height * app->zoom;
-          draw_w = draw_h * image_aspect;
-        } else {
-          draw_w = app->width * app->zoom;
-          draw_h = draw_w / image_aspect;
-        }
-
-        double scale_x = draw_w / w;
-        double scale_y = draw_h / h;
-        double offset_x = (app->width - draw_w) / 2.0 + app->pan_x;
-        double offset_y = (app->height - draw_h) / 2.0 + app->pan_y;
+            (unsigned char*)region.pixels, opaque ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
+            region.w, region.h, region.stride * 4);
 
         cairo_save(cr);
-        cairo_translate(cr, offset_x, offset_y);
-        cairo_scale(cr, scale_x, scale_y);
-        cairo_set_source_surface(cr, img_surface, 0, 0);
-        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_FAST);
+        cairo_translate(cr, layout.offset_x, layout.offset_y);
+        cairo_scale(cr, scale_x * region.step, scale_y * region.step);
+        cairo_set_source_surface(cr, img_surface, (double)region.x / region.step, (double)region.y / region.step);
+        // Bilinear while idle, for the moment before the refined pass lands
+        cairo_pattern_set_filter(cairo_get_source(cr), fast_mode ? CAIRO_FILTER_FAST : CAIRO_FILTER_BILINEAR);
         cairo_paint(cr);
         cairo_restore(cr);
         
         cairo_surface_destroy(img_surface);
-        
-    } else {
-        // --- QUALITY PATH (Imlib2) ---
-        Imlib_Image dest_img = imlib_create_image_using_data(draw_width, draw_height, (unsigned int*)app->shm_data);
-        if (dest_img) {
-            imlib_context_set_image(dest_img);
-            
-            double window_aspect = (double)app->width / app->height;
-            double image_aspect = (double)it->second.width / it->second.height;
-
-            double draw_w, draw_h;
-            if (window_aspect > image_aspect) {
-              draw_h = app->height * app->zoom;
-              draw_w = draw_h * image_aspect;
-            } else {
-              draw_w = app->width * app->zoom;
-              draw_h = draw_w / image_aspect;
-            }
-
-            double final_x = (app->width - draw_w) / 2.0 + app->pan_x;
-            double final_y = (app->height - draw_h) / 2.0 + app->pan_y;
-
-            int target_x = (int)(final_x * app->buffer_scale);
-            int target_y = (int)(final_y * app->buffer_scale);
-            int target_w = (int)(draw_w * app->buffer_scale);
-            int target_h = (int)(draw_h * app->buffer_scale);
-
-            imlib_context_set_anti_alias(1);
-            imlib_blend_image_onto_image(src_img, 0, 0, 0, it->second.width, it->second.height, 
-                                         target_x, target_y, target_w, target_h);
-            imlib_free_image();
-        }
     }
+  } else if (!app->images.empty()) {
+    // Placeholder while the current image is still decoding
+    bool pending = decoder_is_pending(app->decoder, app->current_index, DECODE_PIXELS);
+    const char *msg = pending ? "Loading..." : "Unable to load image";
+
+    cairo_select_font_face(cr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, 18.0);
+    cairo_text_extents_t extents;
+    cairo_text_extents(cr, msg, &extents);
+    cairo_set_source_rgba(cr, 1, 1, 1, 0.6);
+    cairo_move_to(cr, (app->width - extents.width) / 2.0, app->height / 2.0);
+    cairo_show_text(cr, msg);
   }
 
-  // Draw UI with Cairo (on top of what Imlib2 just drew)
-  // Re-establish Cairo scaling for UI elements
-  cairo_identity_matrix(cr);
-  cairo_scale(cr, app->buffer_scale, app->buffer_scale);
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
 
-  // Overlay UI
-  if (app->show_info) {
-    std::vector<std::string> lines;
-    int w = 0, h = 0;
-    if (it != app->cache.end()) { w = it->second.width; h = it->second.height; }
-    lines.push_back(app->images[app->current_index]);
-    lines.push_back("Res: " + std::to_string(w) + "x" + std::to_string(h));
-    lines.push_back("Zoom: " + std::to_string(app->zoom).substr(0,4) + "x | Index: " + std::to_string(app->current_index + 1) + "/" + std::to_string(app->images.size()));
-
-    // Use cached metadata
-    if (it != app->cache.end()) {
-        for (const auto& line : it->second.exif_data) {
-            lines.push_back(line);
-        }
-    }
+  submit_damage(app);
+  clear_region(target->damage);
 
-    cairo_select_font_face(cr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-    cairo_set_font_size(cr, 18.0);
+  target->busy = true;
+  v->backdrop_width = backdrop ? draw_width : 0;
+  v->backdrop_height = backdrop ? draw_height : 0;
 
-    // Calculate max width for dynamic background
-    double max_w = 200;
-    for (const auto& line : lines) {
-      cairo_text_extents_t extents;
-      cairo_text_extents(cr, line.c_str(), &extents);
-      if (extents.width > max_w) max_w = extents.width;
-    }
-    
-    double text_bg_w = max_w + 40;
-    double text_bg_h = lines.size() * 25 + 30;
-
-    // Draw background for info text
-    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.6); // Translucent black
-    cairo_new_sub_path(cr);
-    cairo_arc(cr, 20 + 10, 20 + 10, 10, M_PI, 1.5 * M_PI);
-    cairo_arc(cr, 20 + text_bg_w - 10, 20 + 10, 10, 1.5 * M_PI, 2 * M_PI);
-    cairo_arc(cr, 20 + text_bg_w - 10, 20 + text_bg_h - 10, 10, 0, 0.5 * M_PI);
-    cairo_arc(cr, 20 + 10, 20 + text_bg_h - 10, 10, 0.5 * M_PI, M_PI);
-    cairo_close_path(cr);
-    cairo_fill(cr);
-
-    cairo_set_source_rgba(cr, 1, 1, 1, 1.0); // white    
-    for (size_t i = 0; i < lines.size(); ++i) {
-      cairo_move_to(cr, 40, 50 + i * 25);
-      cairo_show_text(cr, lines[i].c_str());
-    }
+  set_surface_scale(app, app->surface, app->viewport, app->width, app->height);
+  wl_surface_attach(app->surface, target->buffer, 0, 0);
+  return true;
+}
+
+static void paint_info(cairo_t *cr, const overlay_layout &layout) {
+  const std::vector<std::string> &lines = layout.info_lines;
+
+  double text_bg_w = layout.info_rect.width;
+  double text_bg_h = layout.info_rect.height;
+
+  // Draw background for info text
+  cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.6); // Translucent black
+  cairo_new_sub_path(cr);
+  cairo_arc(cr, 20 + 10, 20 + 10, 10, M_PI, 1.5 * M_PI);
+  cairo_arc(cr, 20 + text_bg_w - 10, 20 + 10, 10, 1.5 * M_PI, 2 * M_PI);
+  cairo_arc(cr, 20 + text_bg_w - 10, 20 + text_bg_h - 10, 10, 0, 0.5 * M_PI);
+  cairo_arc(cr, 20 + 10, 20 + text_bg_h - 10, 10, 0.5 * M_PI, M_PI);
+  cairo_close_path(cr);
+  cairo_fill(cr);
+
+  cairo_set_source_rgba(cr, 1, 1, 1, 1.0); // white    
+  for (size_t i = 0; i < lines.size(); ++i) {
+    cairo_move_to(cr, 40, 50 + i * 25);
+    cairo_show_text(cr, lines[i].c_str());
   }
+}
 
-  // Draw Floating UI Buttons (Tray)
-  int btn_w = 40, btn_h = 40, spacing = 20;
-  int tray_w = 3 * btn_w + 4 * spacing;
-  int tray_h = btn_h + 20;
-  double tray_x = (app->width - tray_w) / 2.0;
-  double tray_y = app->height - tray_h - 20;
+static void paint_tray(cairo_t *cr, const overlay_layout &layout) {
+  int btn_w = 40, spacing = 20;
+  double tray_x = layout.tray_rect.x;
+  double tray_y = layout.tray_rect.y;
+  int tray_w = layout.tray_rect.width;
+  int tray_h = layout.tray_rect.height;
 
-  // Only show tray if mouse is near bottom (75%) and app is not zooming or panning
-  if (app->mouse_y > app->height * 0.75 && !(app->zooming_in || app->zooming_out || app->is_panning)) {
-      cairo_save(cr);
-      cairo_set_source_rgba(cr, 0.1, 0.1, 0.1, 0.7); // Dark translucent
-      cairo_new_sub_path(cr);
-      cairo_arc(cr, tray_x + 15, tray_y + 15, 15, M_PI, 1.5 * M_PI);
-      cairo_arc(cr, tray_x + tray_w - 15, tray_y + 15, 15, 1.5 * M_PI, 2 * M_PI);
-      cairo_arc(cr, tray_x + tray_w - 15, tray_y + tray_h - 15, 15, 0, 0.5 * M_PI);
-      cairo_arc(cr, tray_x + 15, tray_y + tray_h - 15, 15, 0.5 * M_PI, M_PI);
-      cairo_close_path(cr);
-      cairo_fill(cr);
-
-      // Draw Icons
-      double start_x = tray_x + spacing;
-      double start_y = tray_y + 10;
-      draw_icon(cr, start_x, start_y, 0); // Prev
-      draw_icon(cr, start_x + btn_w + spacing, start_y, 2); // Info
-      draw_icon(cr, start_x + 2 * (btn_w + spacing), start_y, 1); // Next
-      cairo_restore(cr);
+  cairo_set_source_rgba(cr, 0.1, 0.1, 0.1, 0.7); // Dark translucent
+  cairo_new_sub_path(cr);
+  cairo_arc(cr, tray_x + 15, tray_y + 15, 15, M_PI, 1.5 * M_PI);
+  cairo_arc(cr, tray_x + tray_w - 15, tray_y + 15, 15, 1.5 * M_PI, 2 * M_PI);
+  cairo_arc(cr, tray_x + tray_w - 15, tray_y + tray_h - 15, 15, 0, 0.5 * M_PI);
+  cairo_arc(cr, tray_x + 15, tray_y + tray_h - 15, 15, 0.5 * M_PI, M_PI);
+  cairo_close_path(cr);
+  cairo_fill(cr);
+
+  // Draw Icons
+  double start_x = tray_x + spacing;
+  double start_y = tray_y + 10;
+  draw_icon(cr, start_x, start_y, 0); // Prev
+  draw_icon(cr, start_x + btn_w + spacing, start_y, 2); // Info
+  draw_icon(cr, start_x + 2 * (btn_w + spacing), start_y, 1); // Next
+}
+
+void overlays_init(struct app_state *app) {
+  // Input falls through to the main surface, so hit testing stays in its coordinates
+  struct wl_region *no_input = wl_compositor_create_region(app->compositor);
+  for (struct overlay_surface *o : {&app->info, &app->tray}) {
+    o->surface = wl_compositor_create_surface(app->compositor);
+    o->subsurface = wl_subcompositor_get_subsurface(app->subcompositor, o->surface, app->surface);
+    // Commits show up right away instead of waiting for the image surface
+    wl_subsurface_set_desync(o->subsurface);
+    wl_surface_set_input_region(o->surface, no_input);
+    // Scaled like the window, fractionally when it is
+    if (app->viewport) o->viewport = wp_viewporter_get_viewport(app->viewporter, o->surface);
+  }
+  wl_region_destroy(no_input);
+}
+
+// Show `o` at `rect`, drawn by `paint`, or hide it. False if every buffer
+// of the overlay is still held.
+static bool present_overlay(struct app_state *app, struct overlay_surface *o, bool visible,
+                            const cairo_rectangle_int_t &rect, const overlay_layout &layout,
+                            void (*paint)(cairo_t*, const overlay_layout&)) {
+  if (!visible) {
+    if (o->shown) {
+      wl_surface_attach(o->surface, NULL, 0, 0);
+      wl_surface_commit(o->surface);
+      o->shown = false;
+    }
+    return true;
   }
 
+  double scale = app->buffer_scale;
+  struct shm_buffer *b = acquire_buffer(app, &o->pool, buffer_size(app, rect.width), buffer_size(app, rect.height), 2);
+  if (!b) return false;
+
+  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char*)b->data, CAIRO_FORMAT_ARGB32, b->width, b->height, b->stride);
+  cairo_t *cr = cairo_create(surface);
+  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+  cairo_paint(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+  // Painters draw in window coordinates, text in the overlay font
+  cairo_scale(cr, scale, scale);
+  cairo_translate(cr, -rect.x, -rect.y);
+  if (app->font) {
+    cairo_set_font_face(cr, cairo_scaled_font_get_font_face(app->font));
+    cairo_set_font_size(cr, 18.0);
+  }
+  paint(cr, layout);
   cairo_destroy(cr);
   cairo_surface_destroy(surface);
+  clear_region(b->damage);
+  b->busy = true;
+
+  // The position is applied with the next commit of the image surface
+  if (!o->placed || o->x != rect.x || o->y != rect.y) {
+    wl_subsurface_set_position(o->subsurface, rect.x, rect.y);
+    o->placed = true;
+    o->x = rect.x;
+    o->y = rect.y;
+    app->overlays_moved = true;
+  }
+  set_surface_scale(app, o->surface, o->viewport, rect.width, rect.height);
+  wl_surface_attach(o->surface, b->buffer, 0, 0);
+  wl_surface_damage_buffer(o->surface, 0, 0, b->width, b->height);
+  wl_surface_commit(o->surface);
+  o->shown = true;
+  o->scale = scale;
+  return true;
+}
+
+void update_overlays(struct app_state *app) {
+  overlay_layout &was = app->overlays_drawn;
+  overlay_layout layout = {};
+  layout_tray(app, &layout);
+  bool done = true;
+
+  // The text is only rebuilt and measured when what it shows changed
+  bool info_visible = app->show_info;
+  bool info_shown = !was.info_lines.empty();
+  info_source key = info_visible ? current_info_source(app) : info_source{};
+  if (info_visible != info_shown ||
+      (info_visible && (!same_info_source(key, was.info_key) || app->info.scale != app->buffer_scale))) {
+    if (info_visible) layout_info(app, &layout);
+    if (info_visible && layout.info_lines == was.info_lines && app->info.scale == app->buffer_scale) {
+      // A zoom step too small to print, say
+      was.info_key = key;
+    } else if (present_overlay(app, &app->info, info_visible, layout.info_rect, layout, paint_info)) {
+      was.info_lines = std::move(layout.info_lines);
+      was.info_rect = layout.info_rect;
+      was.info_key = key;
+    } else {
+      done = false;
+    }
+  }
+
+  const cairo_rectangle_int_t &a = layout.tray_rect, &b = was.tray_rect;
+  bool moved = a.x != b.x || a.y != b.y || a.width != b.width || a.height != b.height;
+  if (layout.tray_visible != was.tray_visible ||
+      (layout.tray_visible && (moved || app->tray.scale != app->buffer_scale))) {
+    if (present_overlay(app, &app->tray, layout.tray_visible, layout.tray_rect, layout, paint_tray)) {
+      was.tray_visible = layout.tray_visible;
+      was.tray_rect = layout.tray_rect;
+    } else {
+      done = false;
+    }
+  }
+
+  // Retried once a buffer is released
+  app->overlays_pending = !done;
 }
@@ -3,6 +3,41 @@
 
 #include "app.h"
 
-void create_buffer(struct app_state *app);
+// Render the window into a free buffer of the pool, mark it busy until
+// the compositor releases it and attach it. Returns false, setting
+// pool.starved, if every buffer is still held; the redraw should wait for
+// a release. Only damaged areas are repainted, and the damage is reported
+// with wl_surface_damage_buffer. The overlays are not part of it.
+// During gestures the image is shown on the scaled view instead, and a
+// frame may need nothing attached but still returns true: commit it.
+bool create_buffer(struct app_state *app);
+
+// Mark part of the window, in surface coordinates, for repainting
+void damage_rect(struct app_state *app, int x, int y, int w, int h);
+void damage_all(struct app_state *app);
+
+// Take the preferred fractional scale, or else the output's integer one,
+// as buffer_scale, repainting everything if it changed
+void update_buffer_scale(struct app_state *app);
+
+// Take a finished quality pass from the refiner and redraw with it if it
+// still fits the view
+void refine_collect(struct app_state *app);
+
+// Create the scaled view's subsurface, when wp_viewporter is available.
+// Call before overlays_init() so that it stacks below the overlays.
+void scaled_view_init(struct app_state *app);
+
+// Start loading the overlay font on a thread of its own, so opening the
+// info overlay does not wait for fontconfig. Call once at startup.
+void overlay_font_load(struct app_state *app);
+
+// Create the info and tray subsurfaces, once the main surface exists
+void overlays_init(struct app_state *app);
+
+// Redraw, move, show or hide the overlays whose content or place changed,
+// committing only their subsurfaces. Call before committing the main
+// surface so that moves apply with it.
+void update_overlays(struct app_state *app);
 
 #endif
@@ -0,0 +1,308 @@
+#include "resample.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Weights have 14 fractional bits and horizontally filtered rows keep 7
+// per channel, so both fit the signed 16-bit lanes pmaddwd multiplies
+enum { WEIGHT_BITS = 14, ROW_BITS = 7 };
+
+// Source taps for a run of destination pixels along one axis
+struct axis_filter {
+  int taps;                     // Per destination pixel, zero-padded to the widest
+  std::vector<int> start;       // First source pixel of each destination pixel
+  std::vector<int16_t> weights; // `taps` per destination pixel, summing to 1 << WEIGHT_BITS
+};
+
+// Taps for destination pixels [from, to) of `dst_n` spanning `src_n` source pixels
+static axis_filter make_axis_filter(int src_n, int dst_n, int from, int to) {
+  double scale = (double)dst_n / src_n;
+  int widest = scale < 1 ? (int)std::ceil(1 / scale) + 1 : 2;
+  int n = to - from;
+
+  // Exact weights first, to find how many taps the run really needs
+  std::vector<int> first(n), count(n, 0);
+  std::vector<double> exact((size_t)n * widest);
+  for (int d = from; d < to; ++d) {
+    int i = d - from;
+    double *w = &exact[(size_t)i * widest];
+    if (scale < 1) {
+      // Area: how much of each source pixel the destination pixel covers.
+      // Slivers from rounding would only cost a tap.
+      double a = d / scale, b = std::min((d + 1) / scale, (double)src_n);
+      first[i] = std::min((int)a, src_n - 1);
+      for (int s = first[i]; s < b; ++s) {
+        double cover = std::min(b, s + 1.0) - std::max(a, (double)s);
+        if (cover < 1e-9) {
+          if (count[i] == 0) first[i]++;
+          continue;
+        }
+        w[count[i]++] = cover;
+      }
+    } else {
+      // Bilinear between the two nearest source pixel centers
+      double c = (d + 0.5) / scale - 0.5;
+      int s = (int)std::floor(c);
+      if (s < 0 || s >= src_n - 1) {
+        first[i] = std::clamp(s, 0, src_n - 1);
+        w[count[i]++] = 1;
+      } else {
+        first[i] = s;
+        w[count[i]++] = 1 - (c - s);
+        w[count[i]++] = c - s;
+      }
+    }
+  }
+
+  axis_filter f;
+  f.taps = *std::max_element(count.begin(), count.end());
+  f.start.resize(n);
+  f.weights.assign((size_t)n * f.taps, 0);
+  for (int i = 0; i < n; ++i) {
+    const double *w = &exact[(size_t)i * widest];
+    double total = 0;
+    for (int k = 0; k < count[i]; ++k) total += w[k];
+
+    // Near the far edge the run starts early so every tap stays in the source
+    int s = std::min(first[i], src_n - f.taps);
+    f.start[i] = s;
+    int16_t *out = &f.weights[(size_t)i * f.taps + (first[i] - s)];
+    int sum = 0, big = 0;
+    for (int k = 0; k < count[i]; ++k) {
+      out[k] = (int16_t)std::lround(w[k] / total * (1 << WEIGHT_BITS));
+      sum += out[k];
+      if (out[k] > out[big]) big = k;
+    }
+    // Rounding must neither brighten nor darken
+    out[big] += (1 << WEIGHT_BITS) - sum;
+  }
+  return f;
+}
+
+// Weights k and k + 1 as the 16-bit pair pmaddwd applies to two rows or pixels
+static inline int weight_pair(const int16_t *w, int k, int taps) {
+  int next = k + 1 < taps ? w[k + 1] : 0;
+  return (uint16_t)w[k] | next << 16;
+}
+
+static void filter_row_scalar(const uint32_t *src, const axis_filter &f, uint16_t *out, int from, int n) {
+  for (int i = from; i < n; ++i) {
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(src + f.start[i]);
+    const int16_t *w = &f.weights[(size_t)i * f.taps];
+    for (int c = 0; c < 4; ++c) {
+      int acc = 1 << (WEIGHT_BITS - ROW_BITS - 1);
+      for (int k = 0; k < f.taps; ++k) acc += p[k * 4 + c] * w[k];
+      out[i * 4 + c] = (uint16_t)(acc >> (WEIGHT_BITS - ROW_BITS));
+    }
+  }
+}
+
+static void blend_rows_scalar(const uint16_t *const *rows, const int16_t *w, int taps, uint32_t *out, int from, int n) {
+  uint8_t *o = reinterpret_cast<uint8_t*>(out);
+  for (int i = from * 4; i < n * 4; ++i) {
+    int acc = 1 << (WEIGHT_BITS + ROW_BITS - 1);
+    for (int k = 0; k < taps; ++k) acc += rows[k][i] * w[k];
+    o[i] = (uint8_t)std::min(acc >> (WEIGHT_BITS + ROW_BITS), 255);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Bytes of two neighbouring pixels, channel by channel: B0 B1 G0 G1 R0 R1 A0 A1
+#define TAP_PAIRS _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1)
+
+__attribute__((target("sse4.1")))
+static void filter_row_sse41(const uint32_t *src, const axis_filter &f, uint16_t *out, int n) {
+  const __m128i pairs = TAP_PAIRS;
+  const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - ROW_BITS - 1));
+  for (int i = 0; i < n; ++i) {
+    const uint32_t *p = src + f.start[i];
+    const int16_t *w = &f.weights[(size_t)i * f.taps];
+    __m128i acc = round;
+    int k = 0;
+    for (; k + 2 <= f.taps; k += 2) {
+      __m128i px = _mm_cvtepu8_epi16(_mm_shuffle_epi8(_mm_loadl_epi64((const __m128i*)(p + k)), pairs));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weight_pair(w, k, f.taps))));
+    }
+    if (k < f.taps) {
+      __m128i px = _mm_cvtepu8_epi32(_mm_cvtsi32_si128((int)p[k]));
+      acc = _mm_add_epi32(acc, _mm_mullo_epi32(px, _mm_set1_epi32(w[k])));
+    }
+    acc = _mm_srli_epi32(acc, WEIGHT_BITS - ROW_BITS);
+    _mm_storel_epi64((__m128i*)(out + i * 4), _mm_packus_epi32(acc, acc));
+  }
+}
+
+// Two destination pixels at once, one per 128-bit lane
+__attribute__((target("avx2")))
+static void filter_row_avx2(const uint32_t *src, const axis_filter &f, uint16_t *out, int n) {
+  const __m128i pairs = TAP_PAIRS;
+  const __m256i round = _mm256_set1_epi32(1 << (WEIGHT_BITS - ROW_BITS - 1));
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    const uint32_t *p0 = src + f.start[i], *p1 = src + f.start[i + 1];
+    const int16_t *w0 = &f.weights[(size_t)i * f.taps], *w1 = w0 + f.taps;
+    __m256i acc = round;
+    int k = 0;
+    for (; k + 2 <= f.taps; k += 2) {
+      __m128i a = _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i*)(p0 + k)), pairs);
+      __m128i b = _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i*)(p1 + k)), pairs);
+      __m256i px = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(a, b));
+      int wa = weight_pair(w0, k, f.taps), wb = weight_pair(w1, k, f.taps);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(px, _mm256_setr_epi32(wa, wa, wa, wa, wb, wb, wb, wb)));
+    }
+    if (k < f.taps) {
+      __m256i px = _mm256_cvtepu8_epi32(_mm_insert_epi32(_mm_cvtsi32_si128((int)p0[k]), (int)p1[k], 1));
+      int wa = w0[k], wb = w1[k];
+      acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(px, _mm256_setr_epi32(wa, wa, wa, wa, wb, wb, wb, wb)));
+    }
+    acc = _mm256_srli_epi32(acc, WEIGHT_BITS - ROW_BITS);
+    // Each lane packs its pixel twice; keep one copy of each
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(acc, acc), 0x08);
+    _mm_storeu_si128((__m128i*)(out + i * 4), _mm256_castsi256_si128(packed));
+  }
+  filter_row_scalar(src, f, out, i, n);
+}
+
+// Four pixels at once; rows are paired so one pmaddwd applies two weights
+__attribute__((target("avx2")))
+static void blend_rows_avx2(const uint16_t *const *rows, const int16_t *w, int taps, uint32_t *out, int n) {
+  const __m256i round = _mm256_set1_epi32(1 << (WEIGHT_BITS + ROW_BITS - 1));
+  int i = 0;
+  for (; i + 16 <= n * 4; i += 16) {
+    __m256i lo = round, hi = round;
+    for (int k = 0; k < taps; k += 2) {
+      __m256i a = _mm256_loadu_si256((const __m256i*)(rows[k] + i));
+      __m256i b = k + 1 < taps ? _mm256_loadu_si256((const __m256i*)(rows[k + 1] + i)) : _mm256_setzero_si256();
+      __m256i wk = _mm256_set1_epi32(weight_pair(w, k, taps));
+      lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wk));
+      hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wk));
+    }
+    lo = _mm256_srai_epi32(lo, WEIGHT_BITS + ROW_BITS);
+    hi = _mm256_srai_epi32(hi, WEIGHT_BITS + ROW_BITS);
+    __m256i px = _mm256_packus_epi16(_mm256_packs_epi32(lo, hi), _mm256_setzero_si256());
+    px = _mm256_permute4x64_epi64(px, 0x08);
+    _mm_storeu_si128((__m128i*)(out + i / 4), _mm256_castsi256_si128(px));
+  }
+  blend_rows_scalar(rows, w, taps, out, i / 4, n);
+}
+#endif
+
+#ifdef __SSE2__
+static void blend_rows_sse2(const uint16_t *const *rows, const int16_t *w, int taps, uint32_t *out, int n) {
+  const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS + ROW_BITS - 1));
+  int i = 0;
+  for (; i + 8 <= n * 4; i += 8) {
+    __m128i lo = round, hi = round;
+    for (int k = 0; k < taps; k += 2) {
+      __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+      __m128i b = k + 1 < taps ? _mm_loadu_si128((const __m128i*)(rows[k + 1] + i)) : _mm_setzero_si128();
+      __m128i wk = _mm_set1_epi32(weight_pair(w, k, taps));
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+    }
+    lo = _mm_srai_epi32(lo, WEIGHT_BITS + ROW_BITS);
+    hi = _mm_srai_epi32(hi, WEIGHT_BITS + ROW_BITS);
+    __m128i px = _mm_packus_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)(out + i / 4), px);
+  }
+  blend_rows_scalar(rows, w, taps, out, i / 4, n);
+}
+#endif
+
+static void filter_row(const uint32_t *src, const axis_filter &f, uint16_t *out, int n) {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  static const bool has_sse41 = __builtin_cpu_supports("sse4.1");
+  if (has_avx2) {
+    filter_row_avx2(src, f, out, n);
+    return;
+  }
+  if (has_sse41) {
+    filter_row_sse41(src, f, out, n);
+    return;
+  }
+#endif
+  filter_row_scalar(src, f, out, 0, n);
+}
+
+static void blend_rows(const uint16_t *const *rows, const int16_t *w, int taps, uint32_t *out, int n) {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) {
+    blend_rows_avx2(rows, w, taps, out, n);
+    return;
+  }
+#endif
+#ifdef __SSE2__
+  blend_rows_sse2(rows, w, taps, out, n);
+#else
+  blend_rows_scalar(rows, w, taps, out, 0, n);
+#endif
+}
+
+// Premultiplied `src` over `dst`. Filtering can leave a channel one above
+// its alpha, so sums are clamped rather than carried into the next channel.
+static void composite_over(const uint32_t *src, uint32_t *dst, int n) {
+  for (int i = 0; i < n; ++i) {
+    uint32_t s = src[i], a = s >> 24;
+    if (a == 255) {
+      dst[i] = s;
+      continue;
+    }
+    uint32_t d = dst[i], o = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t c = ((s >> shift) & 0xFF) + (((d >> shift) & 0xFF) * (255 - a) + 127) / 255;
+      o |= std::min(c, 255u) << shift;
+    }
+    dst[i] = o;
+  }
+}
+
+// Reused between frames so a redraw does not allocate; one set per
+// render worker
+static thread_local std::vector<uint16_t> row_ring;
+static thread_local std::vector<uint32_t> blend_scratch;
+
+void resample(const uint32_t *src, int src_width, int src_height, int src_stride,
+              uint32_t *dst, int dst_stride, const cairo_rectangle_int_t &target,
+              const cairo_rectangle_int_t &clip, bool has_alpha) {
+  int x0 = std::max(target.x, clip.x), x1 = std::min(target.x + target.width, clip.x + clip.width);
+  int y0 = std::max(target.y, clip.y), y1 = std::min(target.y + target.height, clip.y + clip.height);
+  if (x1 <= x0 || y1 <= y0 || src_width <= 0 || src_height <= 0) return;
+  int n = x1 - x0;
+
+  axis_filter fx = make_axis_filter(src_width, target.width, x0 - target.x, x1 - target.x);
+  axis_filter fy = make_axis_filter(src_height, target.height, y0 - target.y, y1 - target.y);
+
+  // Horizontally filtered source rows, a window of fy.taps sliding down
+  // with the output; source row r lives in slot r % fy.taps
+  row_ring.resize((size_t)fy.taps * n * 4);
+  std::vector<int> ring_row(fy.taps, -1);
+  std::vector<const uint16_t*> rows(fy.taps);
+  if (has_alpha) blend_scratch.resize(n);
+
+  for (int y = y0; y < y1; ++y) {
+    int first = fy.start[y - y0];
+    for (int k = 0; k < fy.taps; ++k) {
+      int sy = first + k, slot = sy % fy.taps;
+      uint16_t *row = row_ring.data() + (size_t)slot * n * 4;
+      if (ring_row[slot] != sy) {
+        filter_row(src + (size_t)sy * src_stride, fx, row, n);
+        ring_row[slot] = sy;
+      }
+      rows[k] = row;
+    }
+
+    const int16_t *w = &fy.weights[(size_t)(y - y0) * fy.taps];
+    uint32_t *out = dst + (size_t)y * dst_stride + x0;
+    if (has_alpha) {
+      blend_rows(rows.data(), w, fy.taps, blend_scratch.data(), n);
+      composite_over(blend_scratch.data(), out, n);
+    } else {
+      blend_rows(rows.data(), w, fy.taps, out, n);
+    }
+  }
+}
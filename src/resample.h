@@ -0,0 +1,18 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "app.h"
+
+// Scale premultiplied ARGB32 pixels (`src_stride` pixels per row) onto the
+// `target` rectangle of `dst`, writing only the part inside `clip`. Shrinking
+// averages the covered source area and enlarging interpolates bilinearly,
+// the same filters as Imlib2's anti-aliased scaling. Pixels with alpha are
+// composited over what `dst` holds; opaque ones replace it. Uses SSE4.1 or
+// AVX2 where the CPU has them. Every output pixel depends only on the
+// source and `target`, so a clip can be split across threads without
+// changing the result.
+void resample(const uint32_t *src, int src_width, int src_height, int src_stride,
+              uint32_t *dst, int dst_stride, const cairo_rectangle_int_t &target,
+              const cairo_rectangle_int_t &clip, bool has_alpha);
+
+#endif
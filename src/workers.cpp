@@ -0,0 +1,59 @@
+#include "workers.h"
+
+// Take and run tasks until the job has none left. Called with the lock held.
+static void run_tasks(struct worker_pool *pool, std::unique_lock<std::mutex> &lock) {
+  while (pool->next < pool->count) {
+    int i = pool->next++;
+    lock.unlock();
+    pool->task(i);
+    lock.lock();
+    if (--pool->pending == 0) pool->done_cv.notify_all();
+  }
+}
+
+static void worker_main(struct worker_pool *pool) {
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  while (true) {
+    pool->work_cv.wait(lock, [pool] { return pool->stopping || pool->next < pool->count; });
+    if (pool->stopping) return;
+    run_tasks(pool, lock);
+  }
+}
+
+struct worker_pool *worker_pool_create(int threads) {
+  struct worker_pool *pool = new worker_pool();
+  pool->count = pool->next = pool->pending = 0;
+  pool->stopping = false;
+  for (int i = 1; i < threads; ++i) {
+    pool->threads.emplace_back(worker_main, pool);
+  }
+  return pool;
+}
+
+void worker_pool_destroy(struct worker_pool *pool) {
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->stopping = true;
+  }
+  pool->work_cv.notify_all();
+  for (std::thread &t : pool->threads) t.join();
+  delete pool;
+}
+
+int worker_pool_size(struct worker_pool *pool) {
+  return (int)pool->threads.size() + 1;
+}
+
+void worker_pool_run(struct worker_pool *pool, int count, const std::function<void(int)> &task) {
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  pool->task = task;
+  pool->count = count;
+  pool->next = 0;
+  pool->pending = count;
+  if (count > 1) pool->work_cv.notify_all();
+
+  run_tasks(pool, lock);
+  pool->done_cv.wait(lock, [pool] { return pool->pending == 0; });
+  pool->count = pool->next = 0;
+  pool->task = nullptr;
+}
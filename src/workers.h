@@ -0,0 +1,35 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent threads that split one job across cores and return when all
+// of it is done. The calling thread takes tasks too, so a pool of N runs
+// N tasks at once with N - 1 threads of its own.
+struct worker_pool {
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable work_cv; // Wakes workers when a job starts
+  std::condition_variable done_cv; // Wakes the caller when its last task finishes
+  std::function<void(int)> task;
+  int count;   // Tasks in the current job
+  int next;    // First task nobody has taken
+  int pending; // Tasks not finished yet
+  bool stopping;
+};
+
+struct worker_pool *worker_pool_create(int threads);
+void worker_pool_destroy(struct worker_pool *pool);
+
+// Number of tasks the pool runs at once
+int worker_pool_size(struct worker_pool *pool);
+
+// Call task(0) ... task(count - 1) across the pool and wait for all of
+// them. Only one thread may run jobs on a pool.
+void worker_pool_run(struct worker_pool *pool, int count, const std::function<void(int)> &task);
+
+#endif